@@ -0,0 +1,148 @@
+#!/usr/bin/env python
+"""
+Generate the canned corpus in corpus/
+
+The sessions assume an ATmega328P in debugWIRE mode. Each one loads the
+small test program below and then exercises one aspect of a typical
+debugging session. Only the packets sent by GDB are recorded.
+
+  0x00: ldi r16,0      0x02: ldi r17,0
+  0x04: inc r16        0x06: brne 0x0A     0x08: inc r17
+  0x0A: rcall 0x0E     0x0C: rjmp 0x04
+  0x0E: nop            0x10: sts 0x0100,r16 0x14: ret
+"""
+
+import os
+import random
+
+import rsp
+
+PROGRAM = [0xE000, 0xE010, 0x9503, 0xF409, 0x9513, 0xD001, 0xCFFB,
+           0x0000, 0x9300, 0x0100, 0x9508]
+LOOP, SUB, STS, RET = 0x04, 0x0E, 0x10, 0x14
+
+SRAM = 0x800000
+EEPROM = 0x810000
+
+
+def program_bytes():
+    return bytes(b for w in PROGRAM for b in (w & 0xFF, w >> 8))
+
+
+class Session(object):
+    def __init__(self, name, comment):
+        self.name = name
+        self.lines = ["# " + comment]
+
+    def send(self, payload):
+        self.lines.append("0.000000 > " + rsp.escape(rsp.packet(payload)))
+
+    def monitor(self, cmd):
+        self.send("qRcmd," + cmd.encode().hex())
+
+    def connect(self):
+        self.send("qSupported:multiprocess+;swbreak+;hwbreak+;qRelocInsn+;fork-events+;vfork-events+;exec-events+;vContSupported+;QThreadEvents+;no-resumed+")
+        self.send("vMustReplyEmpty")
+        self.send("Hg0")
+        self.send("qTStatus")
+        self.send("?")
+        self.send("qfThreadInfo")
+        self.send("qsThreadInfo")
+        self.send("qAttached")
+        self.send("Hc-1")
+        self.send("qC")
+        self.send("qOffsets")
+        self.send("g")
+        self.monitor("debugwire enable")
+
+    def write(self, addr, data, chunk=64):
+        for i in range(0, len(data), chunk):
+            part = data[i:i+chunk]
+            self.send("M{:x},{:x}:{}".format(addr+i, len(part), part.hex()))
+
+    def read(self, addr, length, chunk=0x7F):
+        for i in range(0, length, chunk):
+            self.send("m{:x},{:x}".format(addr+i, min(chunk, length-i)))
+
+    def load(self, extra=0):
+        data = program_bytes()
+        if extra:
+            rnd = random.Random(328)
+            data += bytes(rnd.randrange(256) for _ in range(extra))
+        self.write(0, data)
+        self.monitor("reset")
+
+    def stop(self):
+        # what GDB reads after each stop
+        self.send("g")
+        self.send("m{:x},2".format(SRAM + 0x8FE))
+
+    def cont(self, bps):
+        for bp in bps:
+            self.send("Z0,{:x},2".format(bp))
+        self.send("vCont;c")
+        for bp in bps:
+            self.send("z0,{:x},2".format(bp))
+        self.stop()
+
+    def step(self, n):
+        for _ in range(n):
+            self.send("vCont;s:1;c")
+            self.stop()
+
+    def detach(self):
+        self.send("D")
+
+    def save(self, directory):
+        with open(os.path.join(directory, self.name + ".rsp"), "w") as f:
+            f.write("\n".join(self.lines) + "\n")
+
+
+def sessions():
+    s = Session("load", "load 2 KiB of code and verify it by reading it back")
+    s.connect()
+    s.load(extra=2048 - len(program_bytes()))
+    s.read(0, 2048)
+    s.detach()
+    yield s
+
+    s = Session("breakpoints", "many breakpoints, continue, and single-stepping")
+    s.connect()
+    s.load()
+    for _ in range(8):
+        s.cont([SUB, STS, RET, LOOP + 4])
+        s.step(4)
+    for _ in range(8):
+        s.cont([SUB])
+    s.detach()
+    yield s
+
+    s = Session("rangestep", "'next' over the subroutine call by range stepping")
+    s.connect()
+    s.load()
+    s.cont([LOOP])
+    for _ in range(16):
+        s.send("vCont;r{:x},{:x}:1;c".format(LOOP, 0x0C))
+        s.stop()
+    s.detach()
+    yield s
+
+    s = Session("memdump", "dump SRAM, flash, and EEPROM, read and write variables")
+    s.connect()
+    s.load()
+    s.cont([STS])
+    s.read(SRAM + 0x100, 2048)
+    s.read(0, 4096)
+    s.read(EEPROM, 1024)
+    for i in range(32):
+        s.send("m{:x},2".format(SRAM + 0x100 + 2*i))
+        s.write(SRAM + 0x100 + 2*i, bytes([i, 0]))
+    s.detach()
+    yield s
+
+
+if __name__ == "__main__":
+    directory = os.path.join(os.path.dirname(os.path.abspath(__file__)), "corpus")
+    os.makedirs(directory, exist_ok=True)
+    for s in sessions():
+        s.save(directory)
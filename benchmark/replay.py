@@ -0,0 +1,175 @@
+#!/usr/bin/env python
+"""
+Replay recorded GDB sessions against dw-link (or any RSP server) and
+report timing and target traffic
+
+  replay.py /dev/ttyUSB0 corpus/*.rsp
+  replay.py --check --json results.json localhost:1234 session.rsp
+
+For each session, the packets sent by GDB are replayed one after the
+other, each one as soon as the reply to the previous one has arrived.
+Reported are the latency per packet type, the end-to-end time, and,
+taken from 'monitor info' before and after the session, the number of
+debugWIRE bytes, flash page erasures and flash page writes.
+"""
+
+import argparse
+import json
+import re
+import sys
+import time
+
+import rsp
+
+COUNTERS = [
+    ("dw_sent", r"debugWIRE bytes sent: (\d+)"),
+    ("dw_received", r"debugWIRE bytes received: (\d+)"),
+    ("erasures", r"Number of flash page erasures so far: (\d+)"),
+    ("writes", r"Number of flash write operations so far: (\d+)"),
+]
+
+
+class Replayer(object):
+    def __init__(self, link, stop_timeout, verbose=False):
+        self.link = link
+        self.stop_timeout = stop_timeout
+        self.verbose = verbose
+        self.split = rsp.Splitter()
+        self.pending = []
+
+    def next_unit(self, deadline):
+        while not self.pending:
+            if time.time() > deadline:
+                return None
+            self.pending += self.split.feed(self.link.read())
+        return self.pending.pop(0)
+
+    def exchange(self, unit, timeout):
+        """Send one unit, return (reply payload, console text) or (None, text) on timeout"""
+        console = ""
+        for _ in range(3):
+            self.link.write(unit)
+            if unit == b"\x03":
+                break
+            ack = self.next_unit(time.time() + 1.0)
+            if ack == b"+":
+                break
+            if ack is not None and ack != b"-":
+                self.pending.insert(0, ack)  # no-ack mode
+                break
+        deadline = time.time() + timeout
+        while True:
+            reply = self.next_unit(deadline)
+            if reply is None:
+                return None, console
+            if not reply.startswith(b"$"):
+                continue
+            self.link.write(b"+")
+            if rsp.is_console(reply):
+                console += bytes.fromhex(rsp.payload_of(reply)[1:].decode()).decode("latin-1")
+                continue
+            if self.verbose:
+                print("  {} -> {}".format(rsp.escape(unit[:40]), rsp.escape(reply[:40])))
+            return rsp.payload_of(reply), console
+
+    def counters(self):
+        _, text = self.exchange(rsp.packet("qRcmd," + b"info".hex()), 2.0)
+        values = {}
+        for name, pattern in COUNTERS:
+            m = re.search(pattern, text)
+            if m:
+                values[name] = int(m.group(1))
+        return values
+
+
+def kind(payload):
+    if payload[:1] in (b"q", b"Q", b"v"):
+        m = re.match(rb"^[A-Za-z]+(;[a-z])?", payload)
+        return m.group(0).decode()
+    return payload[:1].decode("latin-1")
+
+
+def replay(rp, fname, check):
+    units = rsp.read_capture(fname)
+    stats = {}
+    mismatches = []
+    before = rp.counters()
+    after = None
+    start = time.time()
+    for i, (_, d, unit) in enumerate(units):
+        if d != ">" or unit in (b"+", b"-"):
+            continue
+        payload = rsp.payload_of(unit) or unit
+        if payload[:1] in (b"D", b"k") and after is None:
+            after = rp.counters()  # detaching restarts dw-link
+        running = payload.startswith(b"vCont;c") or payload.startswith(b"vCont;r") or \
+            payload[:1] in (b"c", b"C") or unit == b"\x03"
+        t0 = time.time()
+        reply, _ = rp.exchange(unit, rp.stop_timeout if running else 2.0)
+        dt = time.time() - t0
+        if payload[:1] == b"k":
+            reply = b""
+        if reply is None:
+            print("  no reply to {}".format(rsp.escape(unit[:40])))
+            break
+        s = stats.setdefault(kind(payload), [0, 0.0, 0.0])
+        s[0] += 1
+        s[1] += dt
+        s[2] = max(s[2], dt)
+        if check:
+            for _, rd, runit in units[i+1:]:
+                if rd == ">" and runit not in (b"+", b"-"):
+                    break
+                if rd == "<" and runit.startswith(b"$") and not rsp.is_console(runit):
+                    if rsp.payload_of(runit) != reply:
+                        mismatches.append((payload, rsp.payload_of(runit), reply))
+                    break
+    total = time.time() - start
+    if after is None:
+        after = rp.counters()
+    delta = dict((k, after[k] - before[k]) for k in after if k in before)
+    return {"session": fname, "time": total, "packets": stats,
+            "counters": delta, "mismatches": len(mismatches)}, mismatches
+
+
+def report(result, mismatches):
+    print("{}: {:.3f} s".format(result["session"], result["time"]))
+    print("  {:<16} {:>6} {:>10} {:>10}".format("packet", "count", "mean ms", "max ms"))
+    for k, (n, tot, mx) in sorted(result["packets"].items(), key=lambda x: -x[1][1]):
+        print("  {:<16} {:>6d} {:>10.2f} {:>10.2f}".format(k, n, tot/n*1000, mx*1000))
+    for name, _ in COUNTERS:
+        if name in result["counters"]:
+            print("  {:<16} {:>6d}".format(name, result["counters"][name]))
+    for cmd, exp, got in mismatches[:5]:
+        print("  mismatch for {}: expected {}, got {}".format(
+            rsp.escape(cmd[:30]), rsp.escape(exp[:30]), rsp.escape(got[:30])))
+
+
+if __name__ == "__main__":
+    p = argparse.ArgumentParser(description="Replay recorded GDB sessions with dw-link")
+    p.add_argument("target", help="serial port of the probe or host:port of an RSP server")
+    p.add_argument("sessions", nargs="+", help="capture files")
+    p.add_argument("-b", "--baud", type=int, default=115200, help="serial speed (default 115200)")
+    p.add_argument("--settle", type=float, default=2.0, help="seconds to wait after opening a serial port")
+    p.add_argument("--stop-timeout", type=float, default=10.0, help="seconds to wait for a stop reply")
+    p.add_argument("--check", action="store_true", help="compare replies with the recorded ones")
+    p.add_argument("--json", help="write results to this file")
+    p.add_argument("-v", "--verbose", action="store_true")
+    args = p.parse_args()
+
+    results = []
+    failed = 0
+    for fname in args.sessions:
+        link = rsp.Link(args.target, args.baud)
+        if link.ser:
+            time.sleep(args.settle)  # opening the port resets the UNO
+        link.read()
+        result, mismatches = replay(Replayer(link, args.stop_timeout, args.verbose), fname, args.check)
+        link.close()
+        report(result, mismatches)
+        results.append(result)
+        failed += len(mismatches)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=1)
+    sys.exit(1 if failed else 0)
@@ -0,0 +1,153 @@
+"""
+Common routines for recording and replaying GDB RSP sessions
+
+Capture format (*.rsp): a text file with one protocol unit per line
+
+    <seconds> <dir> <data>
+
+<seconds> is the time since the start of the recording, <dir> is '>' for
+bytes sent by GDB and '<' for bytes sent by the probe, and <data> is a
+complete packet ($...#xx), an acknowledgement (+ or -), or an interrupt
+(\\x03). Non-printable characters and the backslash are written as \\xNN.
+Lines starting with '#' are comments. A corpus file may contain only the
+'>' lines; the replies are then not checked.
+"""
+
+import re
+import socket
+import time
+
+
+def checksum(payload):
+    return sum(payload) & 0xFF
+
+
+def packet(payload):
+    if isinstance(payload, str):
+        payload = payload.encode("latin-1")
+    return b"$" + payload + b"#" + "{:02x}".format(checksum(payload)).encode()
+
+
+def escape(data):
+    out = []
+    for b in data:
+        if b < 0x20 or b > 0x7E or b == 0x5C:
+            out.append("\\x{:02x}".format(b))
+        else:
+            out.append(chr(b))
+    return "".join(out)
+
+
+def unescape(text):
+    return re.sub(r"\\x([0-9a-fA-F]{2})",
+                  lambda m: chr(int(m.group(1), 16)), text).encode("latin-1")
+
+
+def payload_of(unit):
+    """Payload of a packet unit, with run-length encoding expanded"""
+    if not unit.startswith(b"$"):
+        return None
+    body = unit[1:unit.rindex(b"#")]
+    out = bytearray()
+    i = 0
+    while i < len(body):
+        if body[i] == 0x2A and out and i + 1 < len(body):  # '*'
+            out += bytes([out[-1]]) * (body[i+1] - 29)
+            i += 2
+        else:
+            out.append(body[i])
+            i += 1
+    return bytes(out)
+
+
+def is_console(unit):
+    """True for an 'O' packet carrying console output (and not for 'OK')"""
+    p = payload_of(unit)
+    return (p is not None and len(p) > 1 and p[:1] == b"O" and len(p) % 2 == 1 and
+            re.match(rb"^[0-9a-fA-F]+$", p[1:]) is not None)
+
+
+class Splitter(object):
+    """Splits a byte stream into packets, acks, and interrupts"""
+
+    def __init__(self):
+        self.buf = bytearray()
+
+    def feed(self, data):
+        self.buf += data
+        units = []
+        while self.buf:
+            if self.buf[0] == 0x24:  # '$'
+                end = self.buf.find(b"#")
+                if end < 0 or len(self.buf) < end + 3:
+                    break
+                units.append(bytes(self.buf[:end+3]))
+                del self.buf[:end+3]
+            else:
+                units.append(bytes(self.buf[:1]))
+                del self.buf[:1]
+        return units
+
+
+def read_capture(fname):
+    units = []
+    with open(fname) as f:
+        for line in f:
+            line = line.rstrip("\n")
+            if not line or line.startswith("#"):
+                continue
+            t, d, data = line.split(" ", 2)
+            units.append((float(t), d, unescape(data)))
+    return units
+
+
+class CaptureWriter(object):
+    def __init__(self, fname, comment=None):
+        self.f = open(fname, "w")
+        self.start = time.time()
+        if comment:
+            self.f.write("# {}\n".format(comment))
+
+    def write(self, direction, unit, t=None):
+        if t is None:
+            t = time.time() - self.start
+        self.f.write("{:.6f} {} {}\n".format(t, direction, escape(unit)))
+        self.f.flush()
+
+    def close(self):
+        self.f.close()
+
+
+class Link(object):
+    """Connection to a probe (serial port) or an RSP server (host:port)"""
+
+    def __init__(self, target, baud=115200):
+        self.sock = self.ser = None
+        if re.match(r"^[^/\\]*:\d+$", target):
+            host, port = target.rsplit(":", 1)
+            self.sock = socket.create_connection((host or "localhost", int(port)))
+            self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            self.sock.settimeout(0.05)
+        else:
+            import serial  # only needed for a real probe
+            self.ser = serial.Serial(target, baudrate=baud, timeout=0.05)
+
+    def write(self, data):
+        if self.sock:
+            self.sock.sendall(data)
+        else:
+            self.ser.write(data)
+
+    def read(self):
+        if self.sock:
+            try:
+                return self.sock.recv(4096)
+            except socket.timeout:
+                return b""
+        return self.ser.read(self.ser.in_waiting or 1)
+
+    def close(self):
+        if self.sock:
+            self.sock.close()
+        else:
+            self.ser.close()
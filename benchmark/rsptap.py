@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+"""
+Record the RSP traffic between GDB and dw-link
+
+  rsptap.py -l 2000 -o session.rsp /dev/ttyUSB0
+      GDB connects with 'target remote :2000', all traffic is forwarded
+      to the probe on the serial port and recorded
+
+  rsptap.py --mirror -o session.rsp /dev/ttyACM1
+      records the SDEBUG mirror (Serial1 of a dw-link built with SDEBUG),
+      where both directions are interleaved; the direction is inferred
+      from the alternation of commands and replies
+"""
+
+import argparse
+import select
+import socket
+import sys
+
+import rsp
+
+
+def tap(args):
+    probe = rsp.Link(args.target, args.baud)
+    srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    srv.bind(("localhost", args.listen))
+    srv.listen(1)
+    print("Waiting for GDB on port {:d} ...".format(args.listen))
+    gdb, _ = srv.accept()
+    gdb.setblocking(False)
+    out = rsp.CaptureWriter(args.output, "tap of " + args.target)
+    fromgdb, fromprobe = rsp.Splitter(), rsp.Splitter()
+    try:
+        while True:
+            r, _, _ = select.select([gdb], [], [], 0.001)
+            if r:
+                data = gdb.recv(4096)
+                if not data:
+                    break
+                probe.write(data)
+                for unit in fromgdb.feed(data):
+                    out.write(">", unit)
+            data = probe.read()
+            if data:
+                gdb.sendall(data)
+                for unit in fromprobe.feed(data):
+                    out.write("<", unit)
+    except KeyboardInterrupt:
+        pass
+    out.close()
+    probe.close()
+
+
+def mirror(args):
+    link = rsp.Link(args.target, args.baud)
+    out = rsp.CaptureWriter(args.output, "SDEBUG mirror of " + args.target)
+    split = rsp.Splitter()
+    nextpkt, last = ">", "<"
+    try:
+        while True:
+            for unit in split.feed(link.read()):
+                if unit in (b"+", b"-"):
+                    d = ">" if last == "<" else "<"
+                elif unit == b"\x03":
+                    d, nextpkt = ">", "<"
+                elif rsp.is_console(unit) and nextpkt == "<":
+                    d = "<"               # console output does not end the reply
+                else:
+                    d = nextpkt
+                    nextpkt = "<" if d == ">" else ">"
+                if unit.startswith(b"$"):
+                    last = d
+                out.write(d, unit)
+    except KeyboardInterrupt:
+        pass
+    out.close()
+    link.close()
+
+
+if __name__ == "__main__":
+    p = argparse.ArgumentParser(description="Record GDB RSP sessions with dw-link")
+    p.add_argument("target", help="serial port of the probe (or of the SDEBUG mirror), or host:port")
+    p.add_argument("-o", "--output", required=True, help="capture file")
+    p.add_argument("-l", "--listen", type=int, default=2000, help="TCP port for GDB (default 2000)")
+    p.add_argument("-b", "--baud", type=int, default=115200, help="serial speed (default 115200)")
+    p.add_argument("--mirror", action="store_true", help="record the SDEBUG mirror instead of tapping")
+    args = p.parse_args()
+    if args.mirror:
+        mirror(args)
+    else:
+        tap(args)
+    sys.exit(0)
@@ -1,4 +1,10 @@
 void dwlrestart(void);
+#if STOPWATCH
+void stopwatchStop(unsigned long);
+#endif
+#if TIMEBASE
+unsigned long timebaseTicks();
+#endif
 void blockIRQ();
 void unblockIRQ();
 void setupio();
@@ -27,6 +33,12 @@ void setupDW(void);
 boolean gdbStartConnect(boolean initialconnect);
 boolean gdbConnectDW(void);
 boolean gdbStopConnection(void);
+#if DWPASSTHRU
+void ptHandleFrame(void);
+#endif
+#if WARMDETACH
+boolean gdbWarmConnect(void);
+#endif
 boolean gdbDisconnectDW(void);
 void gdbDwireOption(char arg);
 void gdbReportConnected();
@@ -36,6 +48,16 @@ void gdbSteppingOption(char arg);
 void gdbLoadOption(char arg);
 void gdbOnlyOption(char arg);
 void gdbVerifyOption(char arg);
+void gdbCompressOption(char arg);
+#if SAMPLING
+void gdbSampleOption(char *);
+#endif
+#if PROFILING
+void gdbProfileOption(char *);
+#endif
+#if STOPWATCH
+void gdbStopwatchOption(char);
+#endif
 void gdbTimerOption(char arg);
 void gdbVersion();
 void gdbSetMaxBPs(byte,boolean);
@@ -56,6 +78,7 @@ void simTwoWordInstr(unsigned int, unsigned int);
 boolean gdbLegalStackPointer(unsigned int);
 byte gdbCheckPrerequisite(unsigned int);
 byte gdbStep();
+boolean gdbStepInstruction(unsigned int, unsigned int);
 byte gdbContinue();
 byte gdbRangeStep(const byte*);
 unsigned int analyzeRange(void);
@@ -69,6 +92,7 @@ boolean retxInstr(unsigned int);
 boolean branchInstr(unsigned int);
 void gdbCheckRangeSteppingActive(void);
 void gdbUpdateBreakpoints(byte);
+int gdbAllocateHwbp(unsigned int *, int, int);
 void insertionSort(unsigned int *, int);
 int gdbFindBreakpoint(unsigned int);
 void gdbHandleBreakpointCommand(const byte *);
@@ -77,10 +101,24 @@ void gdbRemoveBreakpoint(unsigned int);
 void gdbCleanupBreakpointTable();
 void gdbReadRegisters();
 void gdbWriteRegisters(const byte *);
-void gdbReadMemory(const byte *);
+void gdbReadMemory(const byte *, boolean);
+void gdbMem2Bin(const byte *, int);
 void gdbHideBREAKs(unsigned int, byte *, int);
+#if !defined(NOQCRC)
+void gdbComputeCRC(const byte *);
+#endif
 void gdbWriteMemory(const byte *, boolean);
 int gdbBin2Mem(const byte *, byte *, int);
+unsigned int gdbUnescape(byte *, const byte *);
+#if !defined(NOQSEARCH)
+void gdbSearchMemory(const byte *, const byte *);
+#endif
+#if ISPLOAD
+void gdbSendMemoryMap(const byte *);
+void gdbFlashErase(const byte *);
+void gdbFlashWrite(const byte *, const byte *);
+void gdbFlashDone();
+#endif
 boolean targetOffline();
 void flushInput();
 void gdbSendByte(byte);
@@ -101,44 +139,79 @@ boolean targetStop();
 int targetSetFuses(Fuses);
 int targetGetClockFuses(Fuses &, Fuses &);
 void targetReadFlashPage(unsigned int);
+boolean targetReadFlashPageUnlessDirty(unsigned int);
 unsigned int targetReadFlashWord(unsigned int);
 void targetReadFlash(unsigned int, byte *, unsigned int);
 void targetReadSram(unsigned int, byte *, unsigned int);
 void targetReadEeprom(unsigned int, byte *, unsigned int);
-void targetWriteFlashPage(unsigned int);
+void targetWriteFlashPage(unsigned int, boolean later = false);
+#if FASTLOAD
+void targetInstallFlashStub(void);
+void targetRemoveFlashStub(void);
+boolean targetFastWritePage(unsigned int, boolean);
+#endif
 void targetWriteFlash(unsigned int, byte *, unsigned int);
-void targetFlushFlashProg();
+void targetFillFlashPage(unsigned int);
+void targetFlushFlashProg(boolean done = true);
+#if FLASHPIPE
+void targetPipeProgram(boolean);
+void targetPipeFinish();
+void gdbPrefetchInput();
+#endif
 void targetWriteSram(unsigned int, byte *, unsigned int);
 void targetWriteEeprom(unsigned int, byte *, unsigned int);
 void targetInitRegisters();
 void targetSaveRegisters();
 void targetRestoreRegisters();
+#if SEMIHOSTING
+boolean targetSemihosting();
+#endif
+#if TIMEBASE
+boolean targetPause(unsigned int &);
+unsigned long targetResume(unsigned long);
+#endif
+#if SAMPLING
+void targetSample();
+#endif
+#if PROFILING
+void targetProfile();
+#endif
 void targetBreak();
+boolean targetBreakAndCalibrate();
 void targetContinue(unsigned int);
 void targetStep();
 boolean targetReset();
 boolean targetIllegalOpcode(unsigned int);
 boolean doBreak(boolean);
-boolean expectUCalibrate();
+#if FASTCONNECT
+void sessionSave(void);
+#endif
+boolean expectUCalibrate(unsigned long maxwait = 800000UL);
+boolean DWspeedUp();
 boolean expectBreakAndU();
 void sendCommand(const uint8_t *, uint8_t);
 unsigned int getResponse(unsigned int);
 unsigned int getResponse(byte *, unsigned int);
 unsigned int getWordResponse(byte);
 void DWsetSpeed(byte);
-byte outHigh(byte, byte);
-byte outLow(byte, byte);
-byte inHigh(byte, byte);
-byte inLow(byte, byte);
+DWINLINE byte outHigh(byte, byte);
+DWINLINE byte outLow(byte, byte);
+DWINLINE byte inHigh(byte, byte);
+DWINLINE byte inLow(byte, byte);
 void DWwriteRegisters(byte *);
+void DWwriteRegisterRange(byte, byte *, byte);
 void DWwriteRegister(byte, byte);
 void DWreadRegisters(byte *);
+void DWreadRegisterRange(byte, byte *, byte);
 byte DWreadRegister(byte, bool);
 void DWwriteSramByte(unsigned int, byte);
+#if FASTLOAD
+void DWwriteSramBytes(unsigned int, const byte *, byte);
+#endif
 void DWwriteIOreg(byte, byte);
 byte DWreadSramByte(unsigned int);
 byte DWreadIOreg(byte);
-void DWreadSramBytes(unsigned int, byte *, byte);
+void DWreadSramBytes(unsigned int, byte *, unsigned int);
 byte DWreadEepromByte(unsigned int);
 void DWwriteEepromByte(unsigned int, byte);
 void DWreadFlash(unsigned int, byte *, unsigned int);
@@ -158,7 +231,8 @@ void disableSpiPins();
 byte ispTransfer(byte);
 byte DWflushInput();
 byte ispSend(byte, byte, byte, byte, boolean);
-boolean enterProgramMode();
+boolean ispWaitReady(byte);
+boolean enterProgramMode(ispspeedtype startspeed = NORMAL_ISP);
 void leaveProgramMode();
 unsigned int ispGetChipId();
 byte ispReadFuse(FuseByte);
@@ -181,7 +255,27 @@ int targetTests(int &);
 int DWtests(int &);
 void ISPprogramming(boolean);
 byte getch();
-void fill(int);
+void fill(byte *, int);
+void skip(unsigned int);
+boolean ispWriteFlash(unsigned int);
+boolean ispProgramPage(const byte *, unsigned int, unsigned int);
+boolean ispStartProgramming();
+#if ISPLOAD
+boolean ispLoadOnlyBlankOutside();
+boolean ispLoadStart();
+void ispLoadBytes(unsigned int, const byte *, unsigned int);
+void ispLoadFlushPage();
+boolean ispLoadFinish();
+boolean ispLoadReconnect();
+#endif
 void empty_reply();
 void breply (byte b);
 void avrisp();
+#if STK500V2
+byte stk2Body(unsigned int);
+void stk2Send(byte);
+void stk2Start(unsigned int, byte);
+void stk2Reply(byte, byte);
+void stk2ByteReply(byte, byte);
+void avrisp2();
+#endif
@@ -60,8 +60,28 @@
 #define HOSTBPS 115200UL      // safe default speed for the host 
 //#define HOSTBPS 230400UL    // works with UNOs, but not with Nanos
 #endif
+#ifndef EXPREGS
+#define EXPREGS 0xF3000000UL  // GP registers sent in stop replies (bit n = rn): r24, r25, r28-r31
+#endif
+#ifndef ISPLOADMIN
+#define ISPLOADMIN 8192UL     // loads of at least that many bytes are programmed by ISP (if ISPLOAD)
+#endif
 // #define STUCKAT1PC 1       // allow also MCUs that have PCs with stuck-at-1 bits
 // #define HIGHSPEEDDW 1      // allow for DW speed up to 250 kbps
+// #define ISPCOMPARE 1       // ISP programmer skips flash pages that already have the right content
+// #define STK500V2 1         // ISP programmer speaks STK500v2 as well (needs more flash, e.g., use NO90)
+// #define SEMIHOSTING 1      // console output from the target by BREAK instructions (needs more flash)
+// #define SAMPLING 1         // periodic sampling of SRAM while the target runs (needs more flash)
+// #define PROFILING 1        // statistical PC sampling while the target runs (needs more flash and RAM)
+// #define STOPWATCH 1        // measure the time between continuing and stopping (needs more flash)
+// #define FLASHPIPE 1        // program a flash page while the host sends the next packet
+// #define ISPLOAD 1          // large loads are programmed by ISP instead of debugWIRE (needs more flash)
+// #define DWPASSTHRU 1       // binary framing mode giving host tools access to debugWIRE primitives
+// #define FASTLOAD 1         // load flash using a loader routine on the target (needs more flash)
+// #define WARMDETACH 1       // 'monitor atexit w' keeps the debugWIRE connection across GDB sessions
+// #define FASTCONNECT 1      // remember the last target in EEPROM and reconnect to it quickly
+// #define ONLYMX8 1          // specialised build for ATmega48/88/168/328(P/PB) only
+// #define ONLYTX5 1          // specialised build for ATtiny25/45/85 only
 
 // these constants should stay undefined for the ordinary user
 // -----------------------------------------------------------
@@ -74,8 +94,12 @@
  #define NOMOVERSION 1      // disable version command
  #define NOEXTREM 1         // disable extern remote
  #define NO90   1           // remove AT90 MCUs
+ #define NOQCRC 1           // disable qCRC packet
+ #define NOQSEARCH 1        // disable qSearch:memory packet
 #endif
 // #define NOMOINFO 1         // disable monitor info command
+// #define NOQCRC 1           // disable qCRC packet (used by compare-sections)
+// #define NOQSEARCH 1        // disable qSearch:memory packet (used by find)
 // #define NONYI 1            // disable NYI messages
 // #define NOMEGA 1           // remove ATmega MCUs
 // #define NOTINY 1           // remove ATtiny MCUs
@@ -97,6 +121,55 @@
 #define UNITGDB 1
 #endif
 
+// specialised builds: the device descriptor values used by the
+// DW primitives become constants, the flash cache shrinks to the
+// family's page size, and all other MCUs are removed (the ISP
+// programmer still handles all MCUs and keeps its full page buffer);
+// the RAM saved on the flash cache goes to the GDB packet buffer
+#if ONLYMX8
+ #define NOTINY 1
+ #define NO90 1
+ #define FIXEDMCU 1
+ #define MCUDWDR 0x31
+ #define MCUEECR 0x1F
+ #define MCUEEARH 0x22
+ #define MAXDWPAGESIZE 128
+ #define MAXBUF 383 // 255 + 256 - 128
+ #define MAXBUFHEXSTR "17F"
+#elif ONLYTX5
+ #define NOMEGA 1
+ #define NO90 1
+ #define FIXEDMCU 1
+ #define MCUDWDR 0x22
+ #define MCUEECR 0x1C
+ #define MCUEEARH 0x1F
+ #define MAXDWPAGESIZE 64
+ #define MAXBUF 447 // 255 + 256 - 64
+ #define MAXBUFHEXSTR "1BF"
+#endif
+
+#if FIXEDMCU
+#define MCUEEDR (MCUEECR+1)
+#define MCUEEARL (MCUEECR+2)
+#define DWINLINE inline __attribute__((always_inline)) // opcode builders are folded into constants
+#else
+#define MCUDWDR mcu.dwdr
+#define MCUEECR mcu.eecr
+#define MCUEEDR mcu.eedr
+#define MCUEEARL mcu.eearl
+#define MCUEEARH mcu.eearh
+#define DWINLINE
+#endif
+#if FIXEDMCU && !STUCKAT1PC
+#define MCUSTUCK 0
+#else
+#define MCUSTUCK mcu.stuckat1byte
+#endif
+
+#if SAMPLING || PROFILING || STOPWATCH
+#define TIMEBASE 1           // Timer2 is used as a free running clock
+#endif
+
 #if defined(SHORTSTR)
 #define LONGSHORT(a,b) b
 #else
@@ -114,6 +187,9 @@
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
+#if FASTCONNECT
+#include <avr/eeprom.h>
+#endif
 #include <util/delay.h>
 #include "src/dwSerial.h"
 #include "src/SingleWireSerial_config.h"
@@ -125,16 +201,40 @@
 // convert an integer literal into its hex string representation (without the 0x prefix)
 // some size restrictions
 
-#define MAXBUF 164 // input buffer for GDB communication, initial packet is longer, but will be mostly ignored
-#define MAXBUFHEXSTR "90"  // hex representation string of MAXBUF 
-#define MAXMEMBUF 150 // size of memory buffer
+#ifndef MAXBUF
+#define MAXBUF 255 // input buffer for GDB communication, initial packet is longer, but will be mostly ignored
+#define MAXBUFHEXSTR "FF"  // hex representation string of MAXBUF 
+#endif
+#define MAXMEMBUF 150 // size of memory buffer (only used by unit tests)
+#define STACKRESERVE 400 // RAM left for the stack, scalar globals, and string constants (re-check with FREERAM)
+#if defined(NOXBIN)
+#define XBINFEATURE ""
+#else
+#define XBINFEATURE ";binary-upload+" // we accept 'x' packets
+#endif
+#if ISPLOAD
+#define MMAPFEATURE ";qXfer:memory-map:read+" // GDB loads flash by vFlash packets
+#else
+#define MMAPFEATURE ""
+#endif
 #define MAXPAGESIZE 256 // maximum number of bytes in one flash memory page (for the 64K MCUs)
+#ifndef MAXDWPAGESIZE
+#define MAXDWPAGESIZE MAXPAGESIZE // maximum page size of the MCUs that can be debugged
+#endif
+#define FLASHHEAD 16 // bytes of an old flash page that are read first when comparing
 #define MAXBREAK 16 // maximum of active breakpoints (we need double as many entries for lazy breakpoint setting/removing!)
 #define MAXNAMELEN 16 // maximal length of MCU name (incl. NUL terminator)
 #define MAXBRANCH 16; // maximal number of branch points in range stepping
 
+static_assert(38 + 6*__builtin_popcountl(EXPREGS) <= MAXBUF, "Too many expedited registers");
+#define MAXSAMPLEREGIONS 4 // maximal number of SRAM regions that are sampled
+#define MAXSAMPLE 16 // maximal number of SRAM bytes sampled at once
+static_assert(2*(10 + 2*MAXSAMPLE) < MAXBUF, "Sample record does not fit into buffer");
+#define PROFBUCKETS 32 // number of buckets in the PC histogram
+
 // communication bit rates 
 #define SPEEDHIGH     300000UL // maximum communication speed limit for DW
+#define SHORTBREAKWAIT(bps) (200000000UL/(bps)) // us to wait for the 0x55 after a short break (20 frames)
 #define SPEEDLOW      150000UL // normal speed limit
 #if HIGHSPEED
 #define SPEEDLIMIT SPEEDHIGH
@@ -162,6 +262,27 @@
 #define ASSIGN_ONLY_SWBPS 3
 #define PROTECT_AND_STEAL_HWBP 4
 
+#if DWPASSTHRU
+// debugWIRE passthrough framing and operations (odd memory operations are reads)
+#define PTESC 0x10
+#define PTNAK 0x15
+#define PTRDSRAM 0x01
+#define PTWRSRAM 0x02
+#define PTRDFLASH 0x03
+#define PTWRFLASH 0x04
+#define PTRDEEPROM 0x05
+#define PTWREEPROM 0x06
+#define PTRDREGS 0x07
+#define PTWRREGS 0x08
+#define PTGETPC 0x09
+#define PTSETPC 0x0A
+#define PTEXEC 0x0B
+#define PTSTEP 0x0C
+#define PTCONT 0x0D
+#define PTBREAK 0x0E
+#define PTPOLL 0x0F
+#endif
+
 // types of fatal errors
 #define NO_FATAL 0
 #define CONNERR_NO_ISP_REPLY 1 // connection error: no ISP reply
@@ -217,6 +338,9 @@
 
 // instruction codes
 const unsigned int BREAKCODE = 0x9598;
+#if SEMIHOSTING
+const unsigned int SHMAGIC = 0x5348; // 'SH' in r21:r20 marks a semihosting BREAK
+#endif
 const unsigned int SLEEPCODE = 0x9588;
 const unsigned int NOPCODE   = 0x0000;
 
@@ -231,6 +355,7 @@ struct breakpoint
   boolean active:1;       // breakpoint is active, i.e., has been set by GDB
   boolean inflash:1;      // breakpoint is in flash memory, i.e., BREAK instr has been set in memory
   boolean hw:1;           // breakpoint is a hardware breakpoint, i.e., not set in memory, but HWBP is used
+  boolean hwsaved:1;      // the HWBP has already been counted as having saved a flash write for this bp
   unsigned int waddr;     // word address of breakpoint
   unsigned int opcode;    // opcode that has been replaced by BREAK (in little endian mode)
 } bp[MAXBREAK*2];
@@ -256,6 +381,7 @@ struct context {
   boolean dwactivated:1; // will be true after dw has been activated once; if then NOTCONN_STATE, you need to leave!
   boolean notloaded:1; // when no binary has been loaded yet
   boolean newmonvals:1; // set to true after MCU is transmitted and false once all init done
+  boolean warm:1; // GDB detached, but DW connection, MCU descriptor and session state are kept
   unsigned long bps; // debugWIRE communication speed
   ispspeedtype ispspeed;
 } ctx;
@@ -266,12 +392,14 @@ struct monitorstate {
   boolean early_dw_start:1; // early switch to debugWIRE (after having made the connection to GDB)
   boolean onlysbp:1; // only software breakpoints allowed
   boolean atexit_leave:1; // leave debugWIRE at exit
+  boolean atexit_warm:1; // keep debugWIRE connection alive at exit (no restart of dw-link)
   boolean readbeforewrite:1; // read before write when loading
   boolean noread:1; // no read while loading
   boolean onlywhenloaded:1; // allow execution only after load command
   boolean rangestepping:1; // range-stepping allowed
   boolean safestep:1; // if true, then single step in a safe way, i.e. not interruptable
   boolean verifyload:1; // check whether flash was successful
+  boolean rle:1; // run-length encode replies
   boolean nobootrst:1; // pseudo monitor option: Do not manage BOOTRST fuse
   boolean nodwen:1; // pseudo monitor option: Do not manage DWEN fuse
   boolean nolockbits:1; // pseudo monitor option: Do not manage lockbits
@@ -504,6 +632,7 @@ const byte m64HVEmsk[] PROGMEM = { 0x4e, 0x51, 0xca, 0,
 // eecr is eeprom control io-reg, eearh is eeprom adress reg high io-reg, 
 // sig  sram low eep flsh dwdr  pg er4  boot    eecr eearh  +  db dm    bb bm    name            mask
 #if !defined(NOTINY)              
+#if !defined(ONLYTX5)
   {0x9007,  1, 1,  1,  1, 0x2E,  16, 0, 0x0000, 0x1C, 0x00, 0, 1, 0x08, 0, 0x00, attiny13,      t13mask},
 
   {0x910A,  2, 1,  2,  2, 0x1f,  16, 0, 0x0000, 0x1C, 0x00, 0, 1, 0x80, 0, 0x00, attiny2313,  t2313mask},
@@ -519,9 +648,11 @@ const byte m64HVEmsk[] PROGMEM = { 0x4e, 0x51, 0xca, 0,
   {0x9215,  4, 0,  4,  4, 0x27,   8, 1, 0x0000, 0x1C, 0x1F, 0, 1, 0x40, 0, 0x00, attiny441,    tX41mask}, 
   {0x9315,  8, 0,  8,  8, 0x27,   8, 1, 0x0000, 0x1C, 0x1F, 0, 1, 0x40, 0, 0x00, attiny841,    tX41mask},
   
+#endif
   {0x9108,  2, 1,  2,  2, 0x22,  16, 0, 0x0000, 0x1C, 0x1F, 0, 1, 0x40, 0, 0x00, attiny25,      tX5mask},
   {0x9206,  4, 1,  4,  4, 0x22,  32, 0, 0x0000, 0x1C, 0x1F, 0, 1, 0x40, 0, 0x00, attiny45,      tX5mask},
   {0x930B,  8, 1,  8,  8, 0x22,  32, 0, 0x0000, 0x1C, 0x1F, 0, 1, 0x40, 0, 0x00, attiny85,      tX5mask},
+#if !defined(ONLYTX5)
   
   {0x910C,  2, 1,  2,  2, 0x20,  16, 0, 0x0000, 0x1C, 0x1F, 0, 1, 0x40, 0, 0x00, attiny261,    tX61mask},
   {0x9208,  4, 1,  4,  4, 0x20,  32, 0, 0x0000, 0x1C, 0x1F, 0, 1, 0x40, 0, 0x00, attiny461,    tX61mask},
@@ -537,6 +668,7 @@ const byte m64HVEmsk[] PROGMEM = { 0x4e, 0x51, 0xca, 0,
   
   {0x9412, 16, 0,  4, 16, 0x2E,  16, 1, 0x0000, 0x1C, 0x00, 0, 1, 0x40, 0, 0x00, attiny1634,  t1634mask},
 #endif
+#endif
 
 #if !defined(NOMEGA)
   {0x9205,  8, 0,  4,  4, 0x31,  32, 0, 0x0000, 0x1F, 0x22, 1, 1, 0x40, 0, 0x00, atmega48a,     mX8mask},
@@ -551,6 +683,7 @@ const byte m64HVEmsk[] PROGMEM = { 0x4e, 0x51, 0xca, 0,
   {0x9514, 32, 0, 16, 32, 0x31,  64, 0, 0x3F00, 0x1F, 0x22, 1, 1, 0x40, 1, 0x01, atmega328,     mX8mask},
   {0x950F, 32, 0, 16, 32, 0x31,  64, 0, 0x3F00, 0x1F, 0x22, 1, 1, 0x40, 1, 0x01, atmega328p,    mX8mask},
   {0x9516, 32, 0, 16, 32, 0x31,  64, 0, 0x3F00, 0x1F, 0x22, 1, 1, 0x40, 1, 0x01, atmega328pb, m328pbmsk},
+#if !defined(ONLYMX8)
   
   {0x9389,  8, 0,  8,  8, 0x31,  32, 0, 0x0000, 0x1F, 0x22, 1, 1, 0x80, 1, 0x01, atmega8u2,    mXu2mask}, // untested
   {0x9489,  8, 0,  8, 16, 0x31,  64, 0, 0x0000, 0x1F, 0x22, 1, 1, 0x80, 1, 0x01, atmega16u2,   mXu2mask}, // untested
@@ -562,6 +695,7 @@ const byte m64HVEmsk[] PROGMEM = { 0x4e, 0x51, 0xca, 0,
   {0x9584, 32, 0, 16, 32, 0x31,  64, 0, 0x3F00, 0x1F, 0x22, 1, 1, 0x40, 1, 0x01, atmega32m1,   mXy1mask}, // untested
   {0x9684, 64, 0, 32, 64, 0x31, 128, 0, 0x7F00, 0x1F, 0x22, 1, 1, 0x40, 1, 0x01, atmega64m1,   mXy1mask}, // untested
 #endif
+#endif
 
 #if !defined(NO90)
   {0x9382,  8, 0,  8,  8, 0x31,  64, 0, 0x1E00, 0x1F, 0x22, 1, 1, 0x80, 1, 0x01, at90usb82,    auX2mask}, // untested
@@ -612,6 +746,10 @@ const char mocache[] PROGMEM = "caching";
 const char morange[] PROGMEM = "rangestepping";
 const char moatexit[] PROGMEM = "atexit";
 const char moerasebeforeload[] PROGMEM = "erasebeforeload";
+const char mocompress[] PROGMEM = "compress";
+const char mosample[] PROGMEM = "sample";
+const char moprofile[] PROGMEM = "profile";
+const char mostopwatch[] PROGMEM = "stopwatch";
 
 const char monnobootrst[] PROGMEM = "\x17nobootrst";
 const char monnodwen[] PROGMEM = "\x17nodwen";
@@ -643,19 +781,152 @@ const char moamb[] PROGMEM ="";
 #define MONODWEN 17
 #define MONOLOCK 18
 #define MOMCU 19
-#define MOUNK 20
-#define MOAMB 21
-#define NUMMONCMDS 22
+#define MOCOMPRESS 20
+#define MOSAMPLE 21
+#define MOPROFILE 22
+#define MOSTOPWATCH 23
+#define MOUNK 24
+#define MOAMB 25
+#define NUMMONCMDS 26
 
 // array with all monitor commands
 const char *const mocmds[NUMMONCMDS] PROGMEM = {
   mohelp, moinfo, moversion, modwire, moreset, moload, moonly, moverify, motimers, mobreak,
   mosinglestep, motest, mocache, morange, moatexit, moerasebeforeload, monnobootrst,
-  monnodwen, monnolockbits, monmcu, mounk, moamb }; 
+  monnodwen, monnolockbits, monmcu, mocompress, mosample, moprofile, mostopwatch, mounk, moamb }; 
 
 // some statistics
 long timeoutcnt = 0; // counter for DW read timeouts
 long flashcnt = 0; // number of flash writes 
+long hwbpsaved = 0; // number of page writes avoided by the HWBP allocation
+long erasecnt = 0; // number of flash page erase operations
+long dwrcvd = 0; // number of bytes received from the target
+unsigned long rlein = 0; // reply bytes before run-length encoding
+unsigned long rleout = 0; // reply bytes after run-length encoding
+unsigned int contrunto = 0xFFFF; // runto argument of the last targetContinue
+#if TIMEBASE
+volatile unsigned long tbovf = 0; // number of Timer2 overflows
+#define TICKSPERMS (F_CPU/64000UL) // Timer2 ticks per millisecond
+#define TICKS2US(t) ((t)*(64000000UL/F_CPU)) // convert Timer2 ticks to us
+#endif
+#if SAMPLING
+struct samplestate {
+  unsigned int addr[MAXSAMPLEREGIONS]; // SRAM addresses of the regions
+  byte len[MAXSAMPLEREGIONS]; // number of bytes of each region
+  byte num; // number of regions, sampling is off when 0
+  unsigned int period; // sampling period in ms
+  unsigned long last; // time of last sample (in Timer2 ticks)
+  unsigned long cnt; // number of samples taken
+  unsigned long stopped; // accumulated time the target was stopped (in Timer2 ticks)
+} smp;
+#endif
+#if PROFILING
+struct profilestate {
+  unsigned int hist[PROFBUCKETS]; // PC histogram
+  unsigned int other; // number of samples outside of range
+  unsigned long start; // lowest byte address in histogram
+  byte shift; // log2 of bucket size in bytes
+  unsigned int period; // sampling period in ms, profiling is off when 0
+  unsigned long last; // time of last sample (in Timer2 ticks)
+  unsigned long begin; // time when profiling started (in Timer2 ticks)
+  unsigned long cnt; // number of samples taken
+  unsigned long stopped; // accumulated time the target was stopped (in Timer2 ticks)
+} prof;
+#endif
+#if STOPWATCH
+struct stopwatchstate {
+  boolean running; // target has been started and not stopped since
+  unsigned long start; // time when target was started (in Timer2 ticks)
+  unsigned long paused; // time the target was stopped by dw-link meanwhile (in Timer2 ticks)
+  unsigned long last; // last measured time in us
+  unsigned long min; // minimal time in us
+  unsigned long max; // maximal time in us
+  unsigned long sum; // sum of all times in us
+  unsigned long cnt; // number of measurements
+} sw;
+#endif
+#if FASTLOAD
+// Loader that is put into flash while loading: erase the page at Z if r20 != 0,
+// copy r24 words from SRAM at X into the page buffer, write the page,
+// re-enable the RWW section if r23 != 0, and stop with a BREAK
+const unsigned int flashstub[] PROGMEM = {
+  0x01EF,         //      movw r28, r30
+  0x2344,         //      tst  r20
+  0xF029,         //      breq copy
+  0xBF47,         //      out  SPMCSR, r20
+  0x95E8,         //      spm
+  0xB607,         // w1:  in   r0, SPMCSR
+  0xFC00,         //      sbrc r0, 0
+  0xCFFD,         //      rjmp w1
+  0x2F98,         // copy: mov r25, r24
+  0x900D,         // l:   ld   r0, X+
+  0x901D,         //      ld   r1, X+
+  0xBF67,         //      out  SPMCSR, r22
+  0x95E8,         //      spm
+  0x9632,         //      adiw r30, 2
+  0x959A,         //      dec  r25
+  0xF7C9,         //      brne l
+  0x01FE,         //      movw r30, r28
+  0xBF57,         //      out  SPMCSR, r21
+  0x95E8,         //      spm
+  0xB607,         // w2:  in   r0, SPMCSR
+  0xFC00,         //      sbrc r0, 0
+  0xCFFD,         //      rjmp w2
+  0x2377,         //      tst  r23
+  0xF011,         //      breq done
+  0xBF77,         //      out  SPMCSR, r23
+  0x95E8,         //      spm
+  0x9598 };       // done: break
+struct fastloadstate {
+  boolean installed; // loader is in flash, original page is in target SRAM at rambase+pagesz
+  boolean checked; // the loader has been seen to program a page in this session
+  boolean unusable; // SPM does not work from the loader page (SELFPRGEN unprogrammed)
+  byte pages; // number of pages started during the current load
+  unsigned int stubaddr; // byte address of the loader page
+} fl;
+#endif
+#if FASTCONNECT
+#define SESSIONMAGIC 0x4457 // "DW"
+struct sessiondesc {
+  unsigned int magic; // SESSIONMAGIC if valid
+  unsigned int sig; // signature of the last target
+  byte dwdr; // its DWDR address (only ambiguous for the ATtiny2313/4313)
+  byte ispspeed; // ISP speed that worked last time
+  unsigned long bps; // DW speed after a break (i.e., before speeding up)
+} sess; // RAM copy of the session descriptor
+sessiondesc sessEE EEMEM; // session descriptor of the last successful connection
+#endif
+unsigned long basebps; // DW speed measured after the last break
+#if FLASHPIPE
+#define PIPEMINBPS 50000UL // below, calibrating on the 0x55 (interrupts off) takes longer than the 3-byte UART FIFO lasts
+struct flashpipestate {
+  boolean pending:1; // 'page' holds a page that still has to be programmed at addr
+  boolean dirty:1; // the pending page has to be erased first
+  boolean verify:1; // the programmed page still has to be verified
+  boolean draining:1; // host bytes are moved to 'buf' while programming
+  boolean slow:1; // DW speed has been left at basebps while draining
+  unsigned int addr; // byte address of the pending page
+  int fill; // number of host bytes prefetched into 'buf'
+  int next; // next prefetched byte to be read
+} pipe;
+#endif
+#if ISPLOAD
+#define ISPLOADRANGES 4 // number of (merged) vFlashErase ranges that are remembered
+struct isploadstate {
+  unsigned long erasesz; // number of bytes announced by vFlashErase packets
+  unsigned int erfirst[ISPLOADRANGES]; // first byte address of each announced range
+  unsigned int erlast[ISPLOADRANGES]; // last byte address of each announced range
+  byte ranges; // number of announced ranges, more than ISPLOADRANGES if they did not fit
+  unsigned int pgaddr; // byte address of the page collected in newpage
+  boolean decided:1; // the first vFlashWrite has chosen between DW and ISP
+  boolean isp:1; // the current load is programmed by ISP
+  boolean pgvalid:1; // newpage holds data for the page at pgaddr
+  boolean failed:1; // ISP programming could not be started
+} il;
+#endif
+#if DWPASSTHRU
+boolean ptrunning = false; // target has been started by a passthrough frame
+#endif
 #if FREERAM
 int freeram = 2048; // minimal amount of free memory (only if enabled)
 #endif
@@ -664,10 +935,22 @@ int freeram = 2048; // minimal amount of free memory (only if enabled)
 dwSerial      dw;
 byte          lastsignal;
 
-// communication and memory buffer
-byte membuf[MAXMEMBUF]; // used for storing sram, flash, and eeprom values
+// communication and memory buffers
+// Lifetimes: 'buf' holds a GDB packet from reception until the reply has been sent;
+// memory contents read or written by GDB are converted in place in 'buf'
+// (read: the raw bytes are stored at the end of 'buf' and the reply is built in
+// front of them; write: the data is decoded at the start of the packet data).
+// 'newpage' accumulates flash data between packets while loading and is used for
+// changing breakpoints, 'page' is the flash cache and lives forever.
+// The ISP programmer uses only 'buf' and 'newpage'.
+#if defined(UNITDW) ||  defined(UNITTG) ||  defined(UNITGDB) ||  defined(UNITALL)
+byte membuf[MAXMEMBUF]; // scratch buffer for the unit tests
+#endif
 byte newpage[MAXPAGESIZE]; // one page of flash to program
-byte page[MAXPAGESIZE]; // cached page contents - never overwrite it in the program! 
+byte pgmask[MAXDWPAGESIZE/8]; // bytes of newpage supplied by the host while loading
+#define PGCOVER(i) (pgmask[(i)>>3] |= _BV((i)&7))
+#define PGCOVERED(i) (pgmask[(i)>>3] & _BV((i)&7))
+byte page[MAXDWPAGESIZE]; // cached page contents - never overwrite it in the program! 
 unsigned int lastpg; // address of the cached page
 boolean validpg = false; // if cached page contents is valid
 boolean flashidle; // flash programming is not active
@@ -678,6 +961,41 @@ byte fatalerror = NO_FATAL;
 
 DEBDECLARE();
 
+// all buffers and state structures, the core's Serial buffers, and the DW receive buffer;
+// STACKRESERVE must be at least the RAM size minus this sum minus the minimal free RAM
+// reported by FREERAM (plus what the stack grows below the deepest measureRam() call)
+static_assert(sizeof(ctx) + sizeof(mon) + sizeof(mcu) + sizeof(bp) 
+	      + sizeof(newpage) + sizeof(pgmask) + sizeof(page) + sizeof(buf)
+#if defined(UNITDW) ||  defined(UNITTG) ||  defined(UNITGDB) ||  defined(UNITALL)
+	      + sizeof(membuf)
+#endif
+#if SAMPLING
+	      + sizeof(smp)
+#endif
+#if PROFILING
+	      + sizeof(prof)
+#endif
+#if STOPWATCH
+	      + sizeof(sw)
+#endif
+#if FASTLOAD
+	      + sizeof(fl)
+#endif
+#if FASTCONNECT
+	      + sizeof(sess)
+#endif
+#if FLASHPIPE
+	      + sizeof(pipe)
+#endif
+#if ISPLOAD
+	      + sizeof(il)
+#endif
+#if TXODEBUG
+	      + sizeof(deb)
+#endif
+	      + sizeof(dw) + _SS_MAX_RX_BUFF + SERIAL_RX_BUFFER_SIZE + SERIAL_TX_BUFFER_SIZE
+	      <= RAMEND + 1 - RAMSTART - STACKRESERVE, "Static buffers use too much RAM");
+
 #include "dw-link.h"
 
 
@@ -733,7 +1051,18 @@ ISR(TIMER0_COMPA_vect, ISR_NOBLOCK)
   busy--;
 }
 
+#if TIMEBASE
+// count the overflows of the free running Timer2
+ISR(TIMER2_OVF_vect)
+{
+  tbovf++;
+}
+#endif
+
 byte saveTIMSK0;
+#if TIMEBASE
+byte saveTIMSK2;
+#endif
 byte saveUCSR0B;
 // block all irqs but the timer1 interrupt 
 // that is necessary for receiving bytes over the dw line
@@ -741,6 +1070,10 @@ void blockIRQ(void)
 {
   saveTIMSK0 = TIMSK0;
   TIMSK0 = 0;
+#if TIMEBASE
+  saveTIMSK2 = TIMSK2;
+  TIMSK2 = 0;
+#endif
   saveUCSR0B = UCSR0B;
   UCSR0B &= ~(RXCIE0|TXCIE0|UDRIE0);
 }
@@ -748,6 +1081,9 @@ void blockIRQ(void)
 void unblockIRQ(void)
 {
   TIMSK0 = saveTIMSK0;
+#if TIMEBASE
+  TIMSK2 = saveTIMSK2;
+#endif
   UCSR0B = saveUCSR0B;
 }
 
@@ -771,6 +1107,11 @@ int main(void) {
   DEBLN(F("\ndw-link version " VERSION));
   setupio();
   TIMSK0 = 0; // no millis interrupts
+#if TIMEBASE
+  TCCR2A = 0; // normal mode
+  TCCR2B = _BV(CS22); // prescaler 64, i.e., 4 us per tick at 16 MHz
+  TIMSK2 = _BV(TOIE2);
+#endif
   pinMode(LEDGND, OUTPUT);
   digitalWrite(LEDGND, LOW);
   power(true); // switch target on
@@ -781,6 +1122,11 @@ int main(void) {
   digitalWrite(DEBTX, LOW); // PD3 on UNO
 #endif
   initSession(); // initialize all critical global variables
+#if FASTCONNECT
+  eeprom_read_block(&sess, &sessEE, sizeof(sess));
+  if (sess.magic != SESSIONMAGIC) sess.sig = 0;
+  if (sess.ispspeed > NORMAL_ISP) sess.ispspeed = NORMAL_ISP;
+#endif
   mcu.required[0] = '\0'; // initialize the 'required' label. 
   
   //  DEBLN(F("Now configuereSupply"));
@@ -794,27 +1140,100 @@ int main(void) {
 	ISPprogramming(false);
       else if (Serial.peek() == '0') // sign on for ISP programmer using HOSTBPS
 	ISPprogramming(true);
+#if STK500V2
+      else if (Serial.peek() == 0x1B) // STK500v2 message start using HOSTBPS
+	ISPprogramming(true);
+#endif
     }
+#endif
+#if FLASHPIPE
+    if (pipe.pending) targetPipeProgram(true); // while the host sends the next packet
 #endif
     monitorSystemLoadState();
+#if FLASHPIPE
+    if (Serial.available() || pipe.next < pipe.fill) {
+#else
     if (Serial.available()) {
+#endif
       gdbHandleCmd();
     } else if (ctx.state == RUN_STATE) {
       if (dw.available()) {
+#if STOPWATCH
+	unsigned long stoptime = timebaseTicks();
+#endif
 	byte cc = dw.read();
 	if (cc == 0x0) { // break sent by target
 	  if (expectUCalibrate()) {
+#if SEMIHOSTING
+	    if (targetSemihosting()) { // output has been forwarded, target runs again
+#if STOPWATCH
+	      sw.paused += timebaseTicks() - stoptime;
+#endif
+	      continue;
+	    }
+#endif
+#if STOPWATCH
+	    stopwatchStop(stoptime);
+#endif
 	    DEBLN(F("Execution stopped"));
 	    _delay_us(5); // avoid conflicts on the line
 	    gdbSendState(SIGTRAP);
 	  }
 	}
       }
+#if SAMPLING
+      else if (smp.num && timebaseTicks() - smp.last >= smp.period*TICKSPERMS) {
+	targetSample();
+      }
+#endif
+#if PROFILING
+      else if (prof.period && timebaseTicks() - prof.last >= prof.period*TICKSPERMS) {
+	targetProfile();
+      }
+#endif
     }
   }
   return 0;
 }
 
+#if STOPWATCH
+// record the time between starting the target and receiving the break
+// (received at stoptime), excluding the stops caused by dw-link
+// and the DW overhead of approx. 11 bit-times (the GO command's stop bit
+// and the 0x00 byte of the break)
+void stopwatchStop(unsigned long stoptime)
+{
+  unsigned long us;
+
+  if (!sw.running) return;
+  sw.running = false;
+  us = TICKS2US(stoptime - sw.start - sw.paused);
+  if (ctx.bps && us > 11000000UL/ctx.bps) us -= 11000000UL/ctx.bps;
+  sw.last = us;
+  if (sw.cnt == 0 || us < sw.min) sw.min = us;
+  if (us > sw.max) sw.max = us;
+  sw.sum += us;
+  sw.cnt++;
+}
+#endif
+
+#if TIMEBASE
+// return the time in Timer2 ticks since startup
+unsigned long timebaseTicks(void)
+{
+  byte oldSREG = SREG;
+  byte cnt;
+  unsigned long ovf;
+
+  cli();
+  cnt = TCNT2;
+  ovf = tbovf;
+  if ((TIFR2 & _BV(TOV2)) && cnt < 255) ovf++; // overflow is pending
+  SREG = oldSREG;
+  return (ovf << 8) | cnt;
+}
+#endif
+
 void setupio(void) {
   ledmask = digitalPinToBitMask(SYSLED);
   ledout = portOutputRegister(digitalPinToPort(SYSLED));
@@ -848,7 +1267,7 @@ void monitorSystemLoadState(void) {
     if (ctx.state == LOAD_STATE) {
       if (ctx.bps >= 30000)  // if too slow, wait for next command
                               // instead of asnychronously finishing load 
-	targetFlushFlashProg();
+	targetFlushFlashProg(false); // the load may go on, so keep the loader
       setSysState(DWCONN_STATE);
     }
   }
@@ -859,6 +1278,16 @@ void initSession(void)
 {
   DEBLN(F("initSession"));
   flashidle = true;
+#if DWPASSTHRU
+  ptrunning = false;
+#endif
+#if FASTLOAD
+  fl.checked = fl.unusable = false;
+#endif
+#if FLASHPIPE
+  pipe.pending = pipe.verify = pipe.draining = pipe.slow = false;
+  pipe.next = pipe.fill = 0;
+#endif
   ctx.dwactivated = false;
   ctx.notloaded = true;
   bpcnt = 0;
@@ -879,11 +1308,13 @@ void initSession(void)
 void initMonValues(void)
 {
   mon.atexit_leave = false;
+  mon.atexit_warm = false;
   mon.readbeforewrite = true;
   mon.noread = false;
   mon.safestep = true;
   mon.tmask = 0xDF;
   mon.verifyload = true;
+  mon.rle = true;
   mon.onlywhenloaded = true;
   mon.onlysbp = false;
   mon.maxbreak = MAXBREAK;
@@ -892,6 +1323,12 @@ void initMonValues(void)
   mon.nodwen = false;
   mon.nolockbits = false;
   mon.early_dw_start = false;
+#if SAMPLING
+  smp.num = 0;
+#endif
+#if PROFILING
+  prof.period = 0;
+#endif
 }
 
 
@@ -907,8 +1344,7 @@ void reportFatalError(byte errnum, boolean checkio)
 {
   if (checkio) {
     if (targetOffline()) return; // if offline, ignore error
-    dw.sendBreak();
-    if (!expectUCalibrate()) { // target is not connected any longer
+    if (!targetBreakAndCalibrate()) { // target is not connected any longer
       setSysState(NOTCONN_STATE); // set state and ignore error
       return;
     }
@@ -1000,8 +1436,7 @@ void gdbHandleCmd(void)
     if (ctx.state == RUN_STATE) {
       Serial.flush(); // let the output be printed
       while (Serial.available()) Serial.read(); // ignore everything after ^C 
-      targetBreak(); // stop target
-      if (expectUCalibrate()) {
+      if (targetBreakAndCalibrate()) { // stop target
 	gdbSendState(SIGINT);
       } else {
 	gdbSendState(SIGHUP);
@@ -1012,6 +1447,12 @@ void gdbHandleCmd(void)
   case 0x05: // enquiry, answer back with dw-link
     Serial.print(F("dw-link" VERSION));
     break;
+
+#if DWPASSTHRU
+  case PTESC: // frame of raw debugWIRE operations
+    ptHandleFrame();
+    break;
+#endif
     
   default:
     // simply ignore, we only accept records, ACK/NACK, a Ctrl-C, or an ENQ (=0x05) 
@@ -1025,10 +1466,27 @@ void gdbParsePacket(const byte *buff)
   byte s;
 
   DEBPR(F("gdb packet: ")); DEBLN((char)*buff);
-  if (!flashidle) {
-    if (*buff != 'X' && *buff != 'M')
+  if (!flashidle
+#if FASTLOAD
+      || fl.installed
+#endif
+      ) {
+    if (*buff != 'X' && *buff != 'M'
+#if ISPLOAD
+	&& memcmp_P(buff, (void *)PSTR("vFlashWrite:"), 12) != 0
+#endif
+	)
       targetFlushFlashProg();                         /* finalize flash programming before doing something else */
   } 
+#if DWPASSTHRU
+  if (ptrunning) {                                    /* target started by a passthrough frame */
+    if (ctx.saved) ptrunning = false;                 /* has been stopped by PTBREAK/PTPOLL */
+    else if (*buff != '?') {                          /* still running: do not touch it */
+      gdbSendReply("E01");
+      return;
+    }
+  }
+#endif
   switch (*buff) {
   case '?':                                           /* last signal */
     gdbSendSignal(lastsignal);
@@ -1051,8 +1509,13 @@ void gdbParsePacket(const byte *buff)
     gdbWriteRegisters(buff + 1);
     break;
   case 'm':                                           /* read memory */
-    gdbReadMemory(buff + 1);
+    gdbReadMemory(buff + 1, false);
+    break;
+#if !defined(NOXBIN)
+  case 'x':                                           /* read memory as binary data */
+    gdbReadMemory(buff + 1, true);
     break;
+#endif
   case 'M':                                           /* write memory */
     gdbWriteMemory(buff + 1, false);
     break;
@@ -1062,12 +1525,18 @@ void gdbParsePacket(const byte *buff)
     break;
 #endif
   case 'D':                                           /* detach from target */
+#if WARMDETACH
+    ctx.warm = (mon.atexit_warm && ctx.state == DWCONN_STATE && fatalerror == NO_FATAL);
+#endif
     gdbUpdateBreakpoints(CLEANUP);                    /* remove BREAKS in memory before exit */
     validpg = false;
     fatalerror = NO_FATAL;
     gdbStopConnection();                              
     gdbSendReply("OK");                               /* and signal that everything is OK */
                                                       /* after that avr-gdb will disconnect */
+#if WARMDETACH
+    if (ctx.warm) break;                              /* keep connection, wait for next session */
+#endif
     _delay_ms(500);                                   /* wait a bit */
     if (mon.atexit_leave)
       targetStop();
@@ -1107,6 +1576,14 @@ void gdbParsePacket(const byte *buff)
         gdbSendReply("");
         break;
       }
+#if ISPLOAD
+    } else if (memcmp_P(buf, (void *)PSTR("vFlashErase:"), 12) == 0) {
+      gdbFlashErase(buf + 12);
+    } else if (memcmp_P(buf, (void *)PSTR("vFlashWrite:"), 12) == 0) {
+      gdbFlashWrite(buf + 12, buf + buffill);
+    } else if (memcmp_P(buf, (void *)PSTR("vFlashDone"), 10) == 0) {
+      gdbFlashDone();
+#endif
     } else {
       gdbSendReply("");                             /* not supported */
     }
@@ -1115,11 +1592,16 @@ void gdbParsePacket(const byte *buff)
     if (memcmp_P(buf, (void *)PSTR("qRcmd,"),6) == 0) /* monitor command */
 	gdbParseMonitorPacket(buf+6);
     else if (memcmp_P(buff, (void *)PSTR("qSupported"), 10) == 0) {
-      initSession();                                  /* always init all vars when gdb connects */
-      if (mcu.required[0] == '\0')                    /* if no MCU name given, initialize also monitor values */
-        initMonValues();
-      gdbStartConnect(true);                          /* and try to connect */
-      gdbSendPSTR((const char *)PSTR("PacketSize=" MAXBUFHEXSTR)); /* needs to be given in hexadecimal! */
+#if WARMDETACH
+      if (!gdbWarmConnect())                          /* re-use connection from last session if possible */
+#endif
+      {
+	initSession();                                /* always init all vars when gdb connects */
+	if (mcu.required[0] == '\0')                  /* if no MCU name given, initialize also monitor values */
+	  initMonValues();
+	gdbStartConnect(true);                        /* and try to connect */
+      }
+      gdbSendPSTR((const char *)PSTR("PacketSize=" MAXBUFHEXSTR XBINFEATURE MMAPFEATURE)); /* needs to be given in hexadecimal! */
       ctx.newmonvals = false;                         /* no more mon vals via CLI */
     } else if (memcmp_P(buf, (void *)PSTR("qC"), 2) == 0)      
       gdbSendReply("QC01");                           /* current thread is always 1 */
@@ -1129,6 +1611,18 @@ void gdbParsePacket(const byte *buff)
       gdbSendReply("l");                              /* send end of list */
     else if (memcmp_P(buf, (void *)PSTR("qAttached"), 9) == 0)
       gdbSendReply("1");                              /* tell GDB to use detach when quitting */
+#if !defined(NOQCRC)
+    else if (memcmp_P(buf, (void *)PSTR("qCRC:"), 5) == 0)
+      gdbComputeCRC(buf + 5);                         /* checksum of target memory (compare-sections) */
+#endif
+#if !defined(NOQSEARCH)
+    else if (memcmp_P(buf, (void *)PSTR("qSearch:memory:"), 15) == 0)
+      gdbSearchMemory(buf + 15, buf + buffill);       /* search target memory (find) */
+#endif
+#if ISPLOAD
+    else if (memcmp_P(buf, (void *)PSTR("qXfer:memory-map:read::"), 23) == 0)
+      gdbSendMemoryMap(buf + 23);                     /* flash regions make GDB use vFlash packets */
+#endif
     else
       gdbSendReply("");  /* not supported */
     break;
@@ -1185,6 +1679,24 @@ void gdbParseMonitorPacket(byte *buf)
   case MOVERIFY:
     gdbVerifyOption(cmdbuf[mooptix]);
     break;
+  case MOCOMPRESS:
+    gdbCompressOption(cmdbuf[mooptix]);
+    break;
+#if SAMPLING
+  case MOSAMPLE:
+    gdbSampleOption(&cmdbuf[mooptix]);
+    break;
+#endif
+#if PROFILING
+  case MOPROFILE:
+    gdbProfileOption(&cmdbuf[mooptix]);
+    break;
+#endif
+#if STOPWATCH
+  case MOSTOPWATCH:
+    gdbStopwatchOption(cmdbuf[mooptix]);
+    break;
+#endif
   case MOTIMERS:
     gdbTimerOption(cmdbuf[mooptix]);
     break;
@@ -1219,6 +1731,15 @@ void gdbParseMonitorPacket(byte *buf)
     break;
 #else
   case MOTEST:
+#endif
+#if !SAMPLING
+  case MOSAMPLE:
+#endif
+#if !PROFILING
+  case MOPROFILE:
+#endif
+#if !STOPWATCH
+  case MOSTOPWATCH:
 #endif
   case MOCACHE:
   case MOEBL:
@@ -1344,10 +1865,18 @@ inline void gdbAtExit(char arg) {
   switch (arg) {
   case 's':
     mon.atexit_leave = false;
+    mon.atexit_warm = false;
     break;
   case 'l':
     mon.atexit_leave = true;
+    mon.atexit_warm = false;
+    break;
+#if WARMDETACH
+  case 'w':
+    mon.atexit_leave = false;
+    mon.atexit_warm = true;
     break;
+#endif
   case '\0':
     break;
   default:
@@ -1356,6 +1885,8 @@ inline void gdbAtExit(char arg) {
   }
   if (mon.atexit_leave) 
     gdbReplyMessagePSTR(PSTR(LONGSHORT("Leave debugWIRE at exit","LEAVE")), -1);
+  else if (mon.atexit_warm)
+    gdbReplyMessagePSTR(PSTR(LONGSHORT("Keep debugWIRE connection at exit","WARM")), -1);
   else 
     gdbReplyMessagePSTR(PSTR(LONGSHORT("Stay in debugWIRE at exit","STAY")), -1);
 }
@@ -1386,16 +1917,32 @@ inline void gdbBreakOption(char arg) {
 
 // help function (w/o unit tests)
 void gdbHelp(void) {
+#if WARMDETACH
+  gdbDebugMessagePSTR(PSTR("monitor atexit [s|l|w]       - stay in debugWIRE (s), leave (l), or keep connection (w)"), -1);
+#else
   gdbDebugMessagePSTR(PSTR("monitor atexit [s|l]         - stay in debugWIRE (s) or leave (l) at exit"), -1);
+#endif
   gdbDebugMessagePSTR(PSTR("monitor breakpoints [a|h|s]  - allow all, only hw, or only sw bps"), -1);
+  gdbDebugMessagePSTR(PSTR("monitor compress [e|d]       - run-length encode replies (e) or not (d)"), -1);
   gdbDebugMessagePSTR(PSTR("monitor debugwire [e|d]      - enables (e) or disables (d) debugWIRE"), -1);
   gdbDebugMessagePSTR(PSTR("monitor help                 - help function"), -1);
   gdbDebugMessagePSTR(PSTR("monitor info                 - information about target and debugger"), -1);
   gdbDebugMessagePSTR(PSTR("monitor load [r|w|o]         - loading: read before write(r) or write(w)"), -1);
   gdbDebugMessagePSTR(PSTR("                               only or no flashing initially (n)"), -1);
   gdbDebugMessagePSTR(PSTR("monitor onlywhenloaded [e|d] - allow exec only after load (e) or always (d)"), -1);
+#if PROFILING
+  gdbDebugMessagePSTR(PSTR("monitor profile [d|<ms> [<start> <end>]]"), -1);
+  gdbDebugMessagePSTR(PSTR("                             - PC profiling, show histogram, or disable (d)"), -1);
+#endif
   gdbDebugMessagePSTR(PSTR("monitor reset                - reset target"), -1);
+#if SAMPLING
+  gdbDebugMessagePSTR(PSTR("monitor sample [d|<ms> <addr>[:<len>]...]"), -1);
+  gdbDebugMessagePSTR(PSTR("                             - sample SRAM while running or disable (d)"), -1);
+#endif
   gdbDebugMessagePSTR(PSTR("monitor singlestep [s|i]     - safe or interruptible single-stepping"), -1);
+#if STOPWATCH
+  gdbDebugMessagePSTR(PSTR("monitor stopwatch [r]        - show run times (in us) or reset (r)"), -1);
+#endif
   gdbDebugMessagePSTR(PSTR("monitor timers [f|r]         - timers freeze or run when stopped"), -1);
   gdbDebugMessagePSTR(PSTR("monitor verify [e|d]         - verify flash after load(e) or not (d)"), -1);
   gdbDebugMessagePSTR(PSTR("monitor version              - firmware version"), -1);
@@ -1413,10 +1960,22 @@ void gdbInfo(void) {
     gdbDebugMessagePSTR(PSTR("debugWire is disabled"), -1);
   }
   gdbDebugMessagePSTR(PSTR("\nNumber of flash write operations so far: "), flashcnt);
+  gdbDebugMessagePSTR(PSTR("Number of flash page erasures so far: "), erasecnt);
+  gdbDebugMessagePSTR(PSTR("Flash writes avoided by HWBP allocation: "), hwbpsaved);
+  gdbDebugMessagePSTR(PSTR("debugWIRE bytes sent: "), dw.sent);
+  gdbDebugMessagePSTR(PSTR("debugWIRE bytes received: "), dwrcvd);
 #if FREERAM
   gdbDebugMessagePSTR(PSTR("Minimal number of free RAM bytes: "), freeram);
 #endif
   gdbDebugMessagePSTR(PSTR("Number of debugWIRE timeouts: "), timeoutcnt);
+  gdbDebugMessagePSTR(PSTR("Reply bytes before RLE: "), rlein);
+  gdbDebugMessagePSTR(PSTR("Reply bytes after RLE: "), rleout);
+#if SAMPLING
+  gdbDebugMessagePSTR(PSTR("Number of samples: "), smp.cnt);
+  if (smp.cnt)
+    gdbDebugMessagePSTR(PSTR("Average sampling stop time (us): "),
+			TICKS2US(smp.stopped)/smp.cnt);
+#endif
   if (fatalerror) {
     if (fatalerror < 100) {
       gdbReportConnectionProblem(fatalerror);
@@ -1506,14 +2065,44 @@ void setupDW(void)
   // is not uniquely determined by the chip signature.
 #if !defined(NOTINY)
   if (mcu.dwdr == 0x1F) { // DWDR address on the ATTiny2313 (and only on that MCU!)
-    if (!DWreadRegister(1, true)) { // read register unsuccessful, must be a different address
+#if FASTCONNECT
+    if (sess.sig == mcu.sig) mcu.dwdr = sess.dwdr; // we know it already
+    else
+#endif
+    if (!DWreadRegister(1, true)) // read register unsuccessful, must be a different address
       mcu.dwdr = 0x27;
+    if (mcu.dwdr == 0x27) {
       mcu.name = attiny2313a;
       mcu.maskregs = t4313mask;
     }
   }
 #endif
+#if FASTCONNECT
+  sessionSave();
+#endif
+}
+
+#if FASTCONNECT
+// remember the current target so that the next connect can use the fast path;
+// the measured speed varies a little from connect to connect, so the EEPROM
+// is only written if the target changed or the speed differs by more than 2%
+void sessionSave(void)
+{
+  sessiondesc old;
+  unsigned long diff;
+
+  eeprom_read_block(&old, &sessEE, sizeof(old));
+  diff = (basebps > old.bps ? basebps - old.bps : old.bps - basebps);
+  if (old.magic == SESSIONMAGIC && old.sig == mcu.sig && old.dwdr == mcu.dwdr &&
+      old.ispspeed == sess.ispspeed && diff <= old.bps/50)
+    return;
+  sess.magic = SESSIONMAGIC;
+  sess.sig = mcu.sig;
+  sess.dwdr = mcu.dwdr;
+  sess.bps = basebps;
+  eeprom_update_block(&sess, &sessEE, sizeof(sess)); // writes only changed bytes
 }
+#endif
 
 // start a connection initially (target remote ...)  trying only DW,
 // or through the monitor 'debugwire enable' command, then try everything
@@ -1583,6 +2172,32 @@ boolean gdbStopConnection(void)
   return true; // leave debugger without leaving dW mode
 }
 
+#if WARMDETACH
+// new GDB session after a warm detach: if the target still answers
+// with the same signature, keep calibration, MCU descriptor, and load state
+// and reset only what belongs to the GDB session
+boolean gdbWarmConnect(void)
+{
+  if (!ctx.warm) return false;
+  ctx.warm = false;
+  if (DWgetChipId() != mcu.sig) {
+    DWflushInput();
+    return false;
+  }
+  DEBLN(F("Warm reconnect"));
+  bpcnt = 0;
+  bpused = 0;
+  hwbp = 0xFFFF;
+  lastsignal = 0;
+  buffill = 0;
+  range.start = 0;
+  range.leave = 0xFFFF;
+  setSysState(DWCONN_STATE);
+  gdbCleanupBreakpointTable();
+  return true;
+}
+#endif
+
 // monitor debugwire d
 boolean gdbDisconnectDW(void)
 {
@@ -1780,7 +2395,157 @@ void gdbVerifyOption(char arg)
     gdbReplyMessagePSTR(PSTR(LONGSHORT("Load operations are not verified","NO VERIFY")), -1);
 }
 
+void gdbCompressOption(char arg)
+{
+  if (arg != '\0') {
+    if (arg == 'e')
+      mon.rle = true;
+    else if (arg == 'd')
+      mon.rle = false;
+    else {
+      gdbUnknownOpt();
+      return;
+    }
+  }
+  if (mon.rle) 
+    gdbReplyMessagePSTR(PSTR(LONGSHORT("Replies are run-length encoded","RLE")), -1);
+  else 
+    gdbReplyMessagePSTR(PSTR(LONGSHORT("Replies are not compressed","NO RLE")), -1);
+}
+
+
+
+#if SAMPLING
+// monitor sample: 'd' disables sampling, otherwise a period in ms
+// and up to MAXSAMPLEREGIONS SRAM addresses (with optional length) are expected
+void gdbSampleOption(char *arg)
+{
+  char *end;
+  unsigned long val;
+  byte total = 0;
+
+  if (*arg == 'd') {
+    smp.num = 0;
+  } else if (*arg != '\0') {
+    val = strtoul(arg, &end, 0);
+    if (end == arg || val == 0 || val > 60000) {
+      gdbUnknownOpt();
+      return;
+    }
+    smp.period = val;
+    smp.num = 0;
+    for (arg = end; *arg == ' '; arg++);
+    while (*arg && smp.num < MAXSAMPLEREGIONS) {
+      smp.addr[smp.num] = strtoul(arg, &end, 0) & 0xFFFF; // remove GDB's SRAM offset
+      smp.len[smp.num] = 1;
+      if (end == arg) break;
+      if (*end == ':') {
+	arg = end + 1;
+	smp.len[smp.num] = strtoul(arg, &end, 0);
+      }
+      if (smp.len[smp.num] == 0 || total + smp.len[smp.num] > MAXSAMPLE) break;
+      total += smp.len[smp.num++];
+      for (arg = end; *arg == ' '; arg++);
+    }
+    if (*arg || smp.num == 0) {
+      smp.num = 0;
+      gdbUnknownOpt();
+      return;
+    }
+    smp.last = timebaseTicks();
+    smp.cnt = 0;
+    smp.stopped = 0;
+  }
+  if (smp.num) 
+    gdbReplyMessagePSTR(PSTR(LONGSHORT("Sampling period in ms: ","SAMPLE ")), smp.period);
+  else
+    gdbReplyMessagePSTR(PSTR(LONGSHORT("No sampling","NO SAMPLE")), -1);
+}
+#endif
+
+#if PROFILING
+// monitor profile: 'd' disables profiling, a period in ms (and optionally
+// a flash byte address range) starts it, and without an argument, the
+// histogram and the overhead is shown
+void gdbProfileOption(char *arg)
+{
+  char *end;
+  unsigned long val, start = 0, stop = mcu.flashsz;
+  byte i;
+  char line[12];
+
+  if (*arg == 'd') {
+    prof.period = 0;
+    gdbReplyMessagePSTR(PSTR(LONGSHORT("No profiling","NO PROFILE")), -1);
+    return;
+  }
+  if (*arg == '\0') {
+    if (prof.cnt == 0) {
+      gdbReplyMessagePSTR(PSTR(LONGSHORT("No samples","NONE")), -1);
+      return;
+    }
+    for (i = 0; i < PROFBUCKETS; i++) {
+      if (prof.hist[i] == 0) continue;
+      val = prof.start + ((unsigned long)i << prof.shift);
+      line[0] = nib2hex((val >> 12) & 0xF); // byte address of bucket
+      line[1] = nib2hex((val >> 8) & 0xF);
+      line[2] = nib2hex((val >> 4) & 0xF);
+      line[3] = nib2hex(val & 0xF);
+      line[4] = ':';
+      line[5] = ' ';
+      line[6] = '\0';
+      gdbMessage(line, prof.hist[i], true, false);
+    }
+    gdbDebugMessagePSTR(PSTR(LONGSHORT("Outside of range: ","OTHER ")), prof.other);
+    gdbDebugMessagePSTR(PSTR(LONGSHORT("Bucket size in bytes: ","BUCKET ")), 1 << prof.shift);
+    gdbDebugMessagePSTR(PSTR(LONGSHORT("Average stop time (us): ","STOP ")), TICKS2US(prof.stopped)/prof.cnt);
+    gdbReplyMessagePSTR(PSTR(LONGSHORT("Stop time per mille: ","PERMILLE ")),
+			prof.stopped/((timebaseTicks() - prof.begin)/1000 + 1));
+    return;
+  }
+  val = strtoul(arg, &end, 0);
+  for (arg = end; *arg == ' '; arg++);
+  if (*arg) {
+    start = strtoul(arg, &end, 0) & ~1UL;
+    stop = strtoul(end, &arg, 0);
+  }
+  if (val == 0 || val > 60000 || *arg || stop <= start) {
+    gdbUnknownOpt();
+    return;
+  }
+  memset(&prof, 0, sizeof(prof));
+  prof.start = start;
+  prof.shift = 1; // smallest bucket is one word
+  while ((((unsigned long)PROFBUCKETS) << prof.shift) < stop - start) prof.shift++;
+  prof.period = val;
+  prof.begin = prof.last = timebaseTicks();
+  gdbReplyMessagePSTR(PSTR(LONGSHORT("Profiling period in ms: ","PROFILE ")), prof.period);
+}
+#endif
 
+#if STOPWATCH
+// monitor stopwatch: show the times between continue and stop, 'r' resets the statistics
+void gdbStopwatchOption(char arg)
+{
+  if (arg == 'r') {
+    sw.cnt = 0;
+    sw.sum = 0;
+    sw.max = 0;
+  } else if (arg != '\0') {
+    gdbUnknownOpt();
+    return;
+  }
+  if (sw.cnt == 0) {
+    gdbReplyMessagePSTR(PSTR(LONGSHORT("No measurements","NONE")), -1);
+    return;
+  }
+  gdbDebugMessagePSTR(PSTR(LONGSHORT("Last run time (us): ","LAST ")), sw.last);
+  gdbDebugMessagePSTR(PSTR(LONGSHORT("Minimal run time (us): ","MIN ")), sw.min);
+  gdbDebugMessagePSTR(PSTR(LONGSHORT("Maximal run time (us): ","MAX ")), sw.max);
+  gdbDebugMessagePSTR(PSTR(LONGSHORT("Average run time (us): ","AVG ")), sw.sum/sw.cnt);
+  gdbReplyMessagePSTR(PSTR(LONGSHORT("Number of runs: ","RUNS ")), sw.cnt);
+}
+#endif
 
 void gdbTimerOption(char arg)
 {
@@ -2047,7 +2812,6 @@ byte gdbStep(void)
 {
   unsigned int opcode, arg;
   byte sig;
-  int bpix = gdbFindBreakpoint(ctx.wpc);
 
   getInstruction(opcode, arg);
   sig = gdbCheckPrerequisite(opcode);
@@ -2060,6 +2824,21 @@ byte gdbStep(void)
     targetContinue(ctx.wpc + 1);
     return 0;
   }
+  if (!gdbStepInstruction(opcode, arg)) {
+    reportFatalError(NO_STEP_FATAL, true);
+    return SIGABRT;
+  }
+  return SIGTRAP;
+}
+
+// Execute the instruction (opcode, arg) at the current PC.
+// If it is hidden by a BREAK in flash (or when stepping safely),
+// it is executed offline, otherwise the target makes a single step.
+// Returns false (keeping the old register state) if the target did not stop.
+boolean gdbStepInstruction(unsigned int opcode, unsigned int arg)
+{
+  int bpix = gdbFindBreakpoint(ctx.wpc);
+
   if ((bpix >= 0 &&  bp[bpix].inflash) || mon.safestep) {
     if (twoWordInstr(opcode)) 
       simTwoWordInstr(opcode, arg);
@@ -2074,13 +2853,12 @@ byte gdbStep(void)
     targetStep();
     if (!expectBreakAndU()) {
       ctx.saved = true; // just reinstantiate the old state
-      reportFatalError(NO_STEP_FATAL, true);
-      return SIGABRT;
+      return false;
     } else {
       targetSaveRegisters();
     }
   }
-  return SIGTRAP;
+  return true;
 }
 
 // start to execute at current PC
@@ -2330,9 +3108,10 @@ void gdbCheckRangeSteppingActive(void)
 //
 void gdbUpdateBreakpoints(byte kind)
 {
-  int i, j, ix, rel = 0;
+  int i, j, ix, rel = 0, hwix = -1;
   unsigned int relevant[MAXBREAK*2+1]; // word addresses of relevant locations in flash
   unsigned int addr = 0;
+  boolean realloc = false;
 
   measureRam();
 
@@ -2346,6 +3125,20 @@ void gdbUpdateBreakpoints(byte kind)
   
   DEBPR(F("Update Breakpoints (used/active): ")); DEBPR(bpused); DEBPR(F(" / ")); DEBLN(bpcnt);
 
+  // release the HWBP (unless it is used for range stepping) so that it can
+  // be reassigned once we know which flash pages have to be rewritten
+  if (kind == ASSIGN_ALL_BPS && !mon.onlysbp) {
+    if (hwbp != 0xFFFF) {
+      hwix = gdbFindBreakpoint(hwbp);
+      if (hwix >= 0 && !bp[hwix].hw) hwix = -1;
+    }
+    if (hwbp == 0xFFFF || hwix >= 0) {
+      if (hwix >= 0) bp[hwix].hw = false;
+      hwbp = 0xFFFF;
+      realloc = true;
+    }
+  }
+
   // find relevant BPs
   for (i=0; i < MAXBREAK*2; i++) {
     if (bp[i].used) {                       // only used breakpoints!
@@ -2384,6 +3177,9 @@ void gdbUpdateBreakpoints(byte kind)
     bpcnt--;
   }
 
+  if (realloc)
+    rel = gdbAllocateHwbp(relevant, rel, hwix);
+
   relevant[rel++] = 0xFFFF; // end marker
   DEBPR(F("Relevant bps: "));  DEBLN(rel-1);
 
@@ -2439,6 +3235,43 @@ void gdbUpdateBreakpoints(byte kind)
   DEBPR(F("HWBP=")); DEBLNF(hwbp*2,HEX);
 }
 
+// Assign the HWBP to one of the BPs that still have to be put into flash.
+// Preferably, it goes to a BP whose page would otherwise not be rewritten.
+// Ties are broken in favour of the previous owner, which usually is the
+// most recently inserted BP (often a temporary one that is removed after the next stop).
+// The chosen BP is removed from the relevant list, the new length is returned.
+int gdbAllocateHwbp(unsigned int relevant[], int rel, int prefer)
+{
+  int i, j, ix, choice = -1;
+  byte score, best = 0;
+  unsigned int pgwords = mcu.targetpgsz/2;
+
+  for (i=0; i < rel; i++) {
+    ix = gdbFindBreakpoint(relevant[i]);
+    if (ix < 0 || !bp[ix].active || bp[ix].inflash) continue; // not a BP to be set
+    score = 1;
+    if (ix == prefer) score++;
+    for (j=0; j < rel; j++)
+      if (j != i && relevant[j]/pgwords == relevant[i]/pgwords) break;
+    if (j == rel) score += 2; // only change on this page
+    if (score > best) {
+      best = score;
+      choice = i;
+    }
+  }
+  if (choice < 0) return rel;
+  ix = gdbFindBreakpoint(relevant[choice]);
+  bp[ix].hw = true;
+  hwbp = bp[ix].waddr;
+  if (best >= 3 && !bp[ix].hwsaved) {
+    bp[ix].hwsaved = true;
+    hwbpsaved++;
+  }
+  DEBPR(F("HWBP assigned to: ")); DEBLNF(hwbp*2,HEX);
+  relevant[choice] = relevant[--rel];
+  return rel;
+}
+
 // sort breakpoints so that they can be changed together when they are on the same page
 void insertionSort(unsigned int *seq, int len)
 {
@@ -2476,7 +3309,11 @@ void gdbHandleBreakpointCommand(const byte *buff)
   parseHex(buff + 3 + len + 1, &sz);
   
   /* break type */
+#if ISPLOAD
+  if (buff[1] == '0' || buff[1] == '1') { // GDB asks for HW BPs in flash regions of the memory map
+#else
   if (buff[1] == '0') {
+#endif
     if (buff[0] == 'Z') {
       gdbInsertBreakpoint(byteflashaddr >> 1);
     } else {
@@ -2519,6 +3356,7 @@ void gdbInsertBreakpoint(unsigned int waddr)
       bp[i].waddr = waddr;
       bp[i].active = true;
       bp[i].inflash = false;
+      bp[i].hwsaved = false;
       if (!mon.onlysbp) { // if hardware bps are allowed
 	if (hwbp == 0xFFFF) { // hardware bp unused
 	  bp[i].hw = true;
@@ -2661,19 +3499,20 @@ void gdbWriteRegisters(const byte *buff)
 }
 
 // read out some of the memory and send to it GDB
-void gdbReadMemory(const byte *buff)
+void gdbReadMemory(const byte *buff, boolean binary)
 {
   unsigned long addr;
   unsigned long sz, flag;
-  byte i, b;
+  byte i, b, *mem;
 
   measureRam();
 
   buff += parseHex(buff, &addr);
   /* skip 'xxx,' */
   parseHex(buff + 1, &sz);
-  
-  if (sz > MAXMEMBUF || sz*2 > MAXBUF) { // should not happen because we required packet length to be less
+
+  if (binary && sz > MAXBUF-1) sz = MAXBUF-1; // binary replies may be shorter than requested
+  if (!binary && sz*2 > MAXBUF) { // should not happen because we required packet length to be less
     gdbSendReply("E04");
     reportFatalError(PACKET_LEN_FATAL, false);
     return;
@@ -2686,21 +3525,29 @@ void gdbReadMemory(const byte *buff)
 
   flag = addr & MEM_SPACE_MASK;
   addr &= ~MEM_SPACE_MASK;
-  if (flag == SRAM_OFFSET) targetReadSram(addr, membuf, sz);
+  mem = buf + MAXBUF - sz; // read into the end of buf, the reply is built in front of it
+  if (flag == SRAM_OFFSET) targetReadSram(addr, mem, sz);
   else if (flag == FLASH_OFFSET) {
-    targetReadFlash(addr, membuf, sz);
-    gdbHideBREAKs(addr, membuf, sz);
-  } else if (flag == EEPROM_OFFSET) targetReadEeprom(addr, membuf, sz);
+    targetReadFlash(addr, mem, sz);
+    gdbHideBREAKs(addr, mem, sz);
+  } else if (flag == EEPROM_OFFSET) targetReadEeprom(addr, mem, sz);
   else {
     gdbSendReply("E14");
     return;
   }
-  for (i = 0; i < sz; ++i) {
-    b = membuf[i];
-    buf[i*2 + 0] = nib2hex(b >> 4);
-    buf[i*2 + 1] = nib2hex(b & 0xf);
-  }
-  buffill = sz * 2;
+#if !defined(NOXBIN)
+  if (binary) {
+    gdbMem2Bin(mem, sz);
+  } else
+#endif
+    {
+      for (i = 0; i < sz; ++i) {
+	b = mem[i];
+	buf[i*2 + 0] = nib2hex(b >> 4);
+	buf[i*2 + 1] = nib2hex(b & 0xf);
+      }
+      buffill = sz * 2;
+    }
   gdbSendBuff(buf, buffill);
 }
 
@@ -2726,14 +3573,122 @@ void gdbHideBREAKs(unsigned int startaddr, byte membuf[], int size)
   }
 }
 
-// write to target memory
-void gdbWriteMemory(const byte *buff, boolean binary)
+#if !defined(NOQCRC)
+// qCRC:addr,length
+// CRC-32 as computed by GDB (polynomial 0x04C11DB7, MSB first, initial value 0xFFFFFFFF)
+// over target memory, which is read in chunks into 'buf' with BREAKs hidden
+void gdbComputeCRC(const byte *buff)
 {
-  unsigned long sz, flag, addr,  i;
-  long memsz;
+  unsigned long addr, sz, flag, crc = 0xFFFFFFFFUL;
+  unsigned int chunk, i;
+  byte bit;
 
   measureRam();
-
+  buff += parseHex(buff, &addr);
+  parseHex(buff + 1, &sz);
+  if (targetOffline()) {
+    gdbSendReply("E01");
+    return;
+  }
+  flag = addr & MEM_SPACE_MASK;
+  addr &= ~MEM_SPACE_MASK;
+  if (flag != SRAM_OFFSET && flag != FLASH_OFFSET && flag != EEPROM_OFFSET) {
+    gdbSendReply("E14");
+    return;
+  }
+  while (sz > 0) {
+    chunk = (sz > MAXBUF ? MAXBUF : sz);
+    if (flag == SRAM_OFFSET) targetReadSram(addr, buf, chunk);
+    else if (flag == FLASH_OFFSET) {
+      targetReadFlash(addr, buf, chunk);
+      gdbHideBREAKs(addr, buf, chunk);
+    } else targetReadEeprom(addr, buf, chunk);
+    for (i = 0; i < chunk; i++) {
+      crc ^= (unsigned long)buf[i] << 24;
+      for (bit = 0; bit < 8; bit++)
+	crc = (crc & 0x80000000UL) ? (crc << 1) ^ 0x04C11DB7UL : (crc << 1);
+    }
+    addr += chunk;
+    sz -= chunk;
+  }
+  buf[0] = 'C';
+  for (i = 0; i < 8; i++)
+    buf[i+1] = nib2hex((crc >> (28 - 4*i)) & 0xF);
+  buffill = 9;
+  gdbSendBuff(buf, buffill);
+}
+#endif
+
+#if !defined(NOQSEARCH)
+// qSearch:memory:addr;length;pattern
+// search target memory for the (binary) pattern; the region is read in chunks into
+// 'newpage', which is free because a load has been finished before, and the
+// last pattern length - 1 bytes of each chunk are kept so that matches
+// spanning two chunks are found
+void gdbSearchMemory(const byte *buff, const byte *end)
+{
+  unsigned long addr, len, flag, start;
+  unsigned int patlen, fill = 0, chunk, keep, i;
+  byte *pat;
+
+  measureRam();
+  buff += parseHex(buff, &addr);
+  buff += parseHex(buff + 1, &len) + 2; // skip ';' before and after length
+  pat = (byte *)buff;
+  patlen = gdbUnescape(pat, end);
+  if (targetOffline()) {
+    gdbSendReply("E01");
+    return;
+  }
+  flag = addr & MEM_SPACE_MASK;
+  addr &= ~MEM_SPACE_MASK;
+  if (flag != SRAM_OFFSET && flag != FLASH_OFFSET && flag != EEPROM_OFFSET) {
+    gdbSendReply("E14");
+    return;
+  }
+  if (patlen == 0 || patlen >= sizeof(newpage)) {
+    gdbSendReply("E04");
+    return;
+  }
+  start = addr; // address of newpage[0]
+  while (len > 0) {
+    chunk = sizeof(newpage) - fill;
+    if (chunk > MAXBUF) chunk = MAXBUF;
+    if (chunk > len) chunk = len;
+    if (flag == SRAM_OFFSET) targetReadSram(start + fill, &newpage[fill], chunk);
+    else if (flag == FLASH_OFFSET) {
+      targetReadFlash(start + fill, &newpage[fill], chunk);
+      gdbHideBREAKs(start + fill, &newpage[fill], chunk);
+    } else targetReadEeprom(start + fill, &newpage[fill], chunk);
+    fill += chunk;
+    len -= chunk;
+    for (i = 0; i + patlen <= fill; i++)
+      if (newpage[i] == pat[0] && memcmp(&newpage[i], pat, patlen) == 0) {
+	buf[0] = '1';
+	buf[1] = ',';
+	ultoa(flag | (start + i), (char *)buf + 2, 16);
+	buffill = strlen((char *)buf);
+	gdbSendBuff(buf, buffill);
+	return;
+      }
+    keep = (fill < patlen ? fill : patlen - 1);
+    memmove(newpage, &newpage[fill - keep], keep);
+    start += fill - keep;
+    fill = keep;
+  }
+  gdbSendReply("0");
+}
+#endif
+
+// write to target memory
+void gdbWriteMemory(const byte *buff, boolean binary)
+{
+  unsigned long sz, flag, addr,  i;
+  long memsz;
+  byte *mem;
+
+  measureRam();
+
   if (targetOffline()) {
     gdbSendReply("E01");
     return;
@@ -2744,16 +3699,17 @@ void gdbWriteMemory(const byte *buff, boolean binary)
   buff += parseHex(buff + 1, &sz);
   /* skip , and : delimiters */
   buff += 2;
+  mem = (byte *)buff; // data is decoded in place
 
   // convert to binary data by deleting the escapes
-  if (sz > MAXMEMBUF) { // should not happen because we required packet length to be less
+  if (sz > MAXBUF) { // should not happen because we required packet length to be less
     gdbSendReply("E15");
     reportFatalError(PACKET_LEN_FATAL, false);
     return;
   }
 #if !defined(NOXBIN)
   if (binary) {
-    memsz = gdbBin2Mem(buff, membuf, sz);
+    memsz = gdbBin2Mem(buff, mem, sz);
     if (memsz < 0) { 
       gdbSendReply("E15");
       reportFatalError(NEG_SIZE_FATAL, false);
@@ -2764,8 +3720,8 @@ void gdbWriteMemory(const byte *buff, boolean binary)
 #endif
    {
     for ( i = 0; i < sz; ++i) {
-      membuf[i]  = hex2nib(*buff++) << 4;
-      membuf[i] |= hex2nib(*buff++);
+      mem[i]  = hex2nib(*buff++) << 4;
+      mem[i] |= hex2nib(*buff++);
     }
   }
     
@@ -2777,7 +3733,7 @@ void gdbWriteMemory(const byte *buff, boolean binary)
       gdbSendReply("E13"); 
       return;
     }
-    targetWriteSram(addr, membuf, sz);
+    targetWriteSram(addr, mem, sz);
     break;
   case FLASH_OFFSET:
     if (flashidle) 
@@ -2789,14 +3745,14 @@ void gdbWriteMemory(const byte *buff, boolean binary)
     setSysState(LOAD_STATE);
     ctx.notloaded = false;
     if (!mon.noread)
-      targetWriteFlash(addr, membuf, sz);
+      targetWriteFlash(addr, mem, sz);
     break;
   case EEPROM_OFFSET:
     if (addr+sz > mcu.eepromsz) {
       gdbSendReply("E13"); 
       return;
     }
-    targetWriteEeprom(addr, membuf, sz);
+    targetWriteEeprom(addr, mem, sz);
     break;
   case LOCK_OFFSET:
   case FUSE_OFFSET:
@@ -2811,6 +3767,159 @@ void gdbWriteMemory(const byte *buff, boolean binary)
 }
 
 
+#if ISPLOAD
+// qXfer:memory-map:read::offset,length
+// describe flash (with the erase unit as block size) and the data address space,
+// so that GDB loads flash using vFlashErase, vFlashWrite, and vFlashDone
+void gdbSendMemoryMap(const byte *buff)
+{
+  unsigned long off, len;
+  unsigned int mapsz;
+  char *p = (char *)buf + 1;
+
+  measureRam();
+  buff += parseHex(buff, &off);
+  parseHex(buff + 1, &len);
+  strcpy_P(p, PSTR("<memory-map><memory type=\"ram\" start=\"0x800000\" length=\"0x100000\"/>"
+		   "<memory type=\"flash\" start=\"0x0\" length=\"0x"));
+  p += strlen(p);
+  ultoa(mcu.flashsz, p, 16);
+  p += strlen(p);
+  strcpy_P(p, PSTR("\"><property name=\"blocksize\">0x"));
+  p += strlen(p);
+  ultoa(mcu.targetpgsz, p, 16);
+  p += strlen(p);
+  strcpy_P(p, PSTR("</property></memory></memory-map>"));
+  p += strlen(p);
+  mapsz = p - (char *)buf - 1;
+  if (len > MAXBUF - 5) len = MAXBUF - 5;
+  if (off >= mapsz) len = 0;
+  else if (off + len > mapsz) len = mapsz - off;
+  buf[0] = (off + len >= mapsz ? 'l' : 'm');
+  memmove(buf + 1, buf + 1 + off, len);
+  gdbSendBuff(buf, len + 1);
+}
+
+// vFlashErase:addr,length
+// nothing is erased here, because pages are erased when they are written;
+// the announced lengths only decide whether the load is done by ISP
+void gdbFlashErase(const byte *buff)
+{
+  unsigned long addr, sz;
+
+  measureRam();
+  if (targetOffline()) {
+    gdbSendReply("E01");
+    return;
+  }
+  buff += parseHex(buff, &addr);
+  parseHex(buff + 1, &sz);
+  if (addr + sz > mcu.flashsz) {
+    gdbSendReply("E11");
+    return;
+  }
+  if (il.decided) { // left-over from an aborted load
+    il.decided = il.isp = il.failed = false;
+    il.erasesz = 0;
+    il.ranges = 0;
+  }
+  if (sz == 0) {
+    gdbSendReply("OK");
+    return;
+  }
+  il.erasesz += sz;
+  if (il.ranges > 0 && il.ranges <= ISPLOADRANGES && addr == il.erlast[il.ranges-1] + 1UL)
+    il.erlast[il.ranges-1] = addr + sz - 1; // adjacent to the previous range
+  else {
+    if (il.ranges < ISPLOADRANGES) {
+      il.erfirst[il.ranges] = addr;
+      il.erlast[il.ranges] = addr + sz - 1;
+    }
+    if (il.ranges <= ISPLOADRANGES) il.ranges++;
+  }
+  gdbSendReply("OK");
+}
+
+// vFlashWrite:addr:XX...
+// the first write of a load decides: if GDB wants to erase at least ISPLOADMIN bytes
+// and the chip erase would not destroy anything outside of the announced ranges,
+// we switch to ISP, otherwise the data goes the same way as with an 'X' packet,
+// where unchanged pages are skipped
+void gdbFlashWrite(const byte *buff, const byte *end)
+{
+  unsigned long addr;
+  unsigned int sz = 0;
+  byte *mem;
+
+  measureRam();
+  if (targetOffline() || il.failed) {
+    gdbSendReply("E01");
+    return;
+  }
+  buff += parseHex(buff, &addr);
+  mem = (byte *)buff + 1; // skip ':', data is decoded in place
+  sz = gdbUnescape(mem, end);
+  if (addr + sz > mcu.flashsz) {
+    gdbSendReply("E11");
+    return;
+  }
+  if (!il.decided) {
+    il.decided = true;
+    il.isp = (il.erasesz >= ISPLOADMIN && !mon.noread && ispLoadOnlyBlankOutside());
+    if (il.isp && !ispLoadStart()) {
+      il.failed = true;
+      gdbSendReply("E01");
+      return;
+    }
+  }
+  setSysState(LOAD_STATE);
+  ctx.notloaded = false;
+  if (il.isp) {
+    ispLoadBytes(addr, mem, sz);
+  } else {
+    if (flashidle)
+      gdbUpdateBreakpoints(CLEANUP); // make sure all BPs are gone from memory when starting to write flash
+    if (!mon.noread)
+      targetWriteFlash(addr, mem, sz);
+  }
+  gdbSendReply("OK");
+}
+
+// vFlashDone
+// the DW path has already been flushed before this packet is parsed,
+// an ISP load has to be finished and debugWIRE mode has to be re-entered
+void gdbFlashDone(void)
+{
+  boolean succ = !il.failed;
+
+  measureRam();
+  if (il.isp && succ)
+    succ = ispLoadFinish();
+  il.decided = il.isp = il.failed = false;
+  il.erasesz = 0;
+  il.ranges = 0;
+  gdbSendReply(succ ? "OK" : "E01");
+}
+#endif
+
+// decode binary data from a packet in place (up to 'end') and return its length;
+// unlike gdbBin2Mem, the length is not known in advance
+unsigned int gdbUnescape(byte *buff, const byte *end)
+{
+  byte *mem = buff;
+  unsigned int sz = 0;
+
+  while (buff < end) {
+    if (*buff == 0x7d && buff + 1 < end) {
+      buff++;
+      mem[sz++] = *buff++ ^ 0x20;
+    } else {
+      mem[sz++] = *buff++;
+    }
+  }
+  return sz;
+}
+
 // Convert the binary stream in BUF to memory.
 // Gdb will escape $, #, and the escape char (0x7d).
 // COUNT is the total number of bytes to read
@@ -2845,6 +3954,29 @@ int gdbBin2Mem(const byte *buf, byte *mem, int count) {
   return num;
 }
 
+#if !defined(NOXBIN)
+// Convert memory to a binary reply in BUF ('b' followed by the data).
+// $, #, the escape char (0x7d), and * are escaped.
+// Stops when BUF is full, so fewer than SZ bytes may be sent
+void gdbMem2Bin(const byte *mem, int sz)
+{
+  byte b;
+
+  measureRam();
+  buf[0] = 'b';
+  buffill = 1;
+  while (sz-- > 0 && buffill < MAXBUF-1) {
+    b = *mem++;
+    if (b == '#' || b == '$' || b == '}' || b == '*') {
+      if (sz > 0 && buf + buffill + 1 >= mem) break; // would overwrite unread bytes (mem is at the end of buf)
+      buf[buffill++] = '}';
+      b ^= 0x20;
+    }
+    buf[buffill++] = b;
+  }
+}
+#endif
+
 // check whether connected
 boolean targetOffline(void)
 {
@@ -2859,9 +3991,28 @@ boolean targetOffline(void)
 // clear input buffer
 void flushInput()
 {
+#if FLASHPIPE
+  pipe.next = pipe.fill = 0;
+#endif
   while (Serial.available()) Serial.read(); 
 }
 
+#if FLASHPIPE
+// move host bytes that arrived meanwhile to 'buf', because the serial receive
+// buffer is much smaller than a packet; 'buf' is free after the reply has been sent
+// and the packet is later parsed in place, since it always lags behind the raw bytes 
+void gdbPrefetchInput(void)
+{
+  while (Serial.available() && pipe.fill <= MAXBUF) {
+    buf[pipe.fill] = Serial.read();
+#if SDEBUG
+    Serial1.write(buf[pipe.fill]);
+#endif
+    pipe.fill++;
+  }
+}
+#endif
+
 // send byte host
 inline void gdbSendByte(byte b)
 {
@@ -2874,6 +4025,10 @@ inline void gdbSendByte(byte b)
 // blocking read byte from host
 inline byte gdbReadByte(void)
 {
+#if FLASHPIPE
+  if (pipe.next < pipe.fill) return buf[pipe.next++]; // received while programming flash
+  pipe.next = pipe.fill = 0;
+#endif
   while (!Serial.available());
 #if SDEBUG
   byte b = Serial.read();
@@ -2911,15 +4066,37 @@ void gdbSendBuff(const byte *buff, int sz)
   measureRam();
 
   byte sum = 0;
+  byte c, rep;
   // If a CTRL-C is in the input buffer, do not send the packet
   // That helps to stop a single-stepping loop!
   if (Serial.available() && Serial.peek() == 0x03) return;
+  rlein += sz;
   gdbSendByte('$');
   while ( sz-- > 0)
     {
-      gdbSendByte(*buff);
-      sum += *buff;
-      buff++;
+      c = *buff++;
+      gdbSendByte(c);
+      sum += c;
+      rleout++;
+      rep = 0;
+      if (c == '}' && sz > 0) { // never compress escape pairs
+	c = *buff++;
+	sz--;
+	gdbSendByte(c);
+	sum += c;
+	rleout++;
+      } else if (mon.rle) {
+	while (rep < sz && rep < 126-29 && buff[rep] == c) rep++;
+	if (rep == 6 || rep == 7) rep = 5; // '#' and '$' are not allowed as repeat counts
+	if (rep >= 3) { // "c* " is shorter than "cccc"
+	  gdbSendByte('*');
+	  gdbSendByte(rep+29);
+	  sum += '*' + rep + 29;
+	  rleout += 2;
+	  buff += rep;
+	  sz -= rep;
+	}
+      }
     }
   gdbSendByte('#');
   gdbSendByte(nib2hex((sum >> 4) & 0xf));
@@ -2951,19 +4128,20 @@ void gdbState2Buf(byte signo)
   unsigned long wpc = (unsigned long)ctx.wpc << 1;
 
   /* thread is always 1 */
-  /* Real packet sent is e.g. T0520:82;21:fb08;22:021b0000;thread:1;
+  /* Real packet sent is e.g. T0520:82;21:fb08;22:021b0000;18:00;19:01;...;thread:1;
      05 - last signal response
      Numbers 20, 21,... are number of register in hex in the same order as in read registers
      20 (32 dec) = SREG
      21 (33 dec) = SP
      22 (34 dec) = PC (byte address)
+     followed by the expedited general purpose registers selected by EXPREGS
   */
   measureRam();
 
   memcpy_P(buf,
-	   PSTR("TXX20:XX;21:XXXX;22:XXXXXXXX;thread:1;"),
-	   38);
-  buffill = 38;
+	   PSTR("TXX20:XX;21:XXXX;22:XXXXXXXX;"),
+	   29);
+  buffill = 29;
   
   /* signo */
   buf[1] = nib2hex((signo >> 4)  & 0xf);
@@ -2988,10 +4166,27 @@ void gdbState2Buf(byte signo)
   buf[25] = nib2hex((wpc >> 16) & 0xf);
   buf[26] = '0'; /* gdb wants 32-bit value, send 0 */
   buf[27] = '0'; /* gdb wants 32-bit value, send 0 */
+
+  /* expedited registers, saving GDB a 'g' packet after most stops */
+  for (byte r = 0; r < 32; r++) {
+    if (EXPREGS & (1UL << r)) {
+      buf[buffill++] = nib2hex(r >> 4);
+      buf[buffill++] = nib2hex(r & 0xf);
+      buf[buffill++] = ':';
+      buf[buffill++] = nib2hex(ctx.regs[r] >> 4);
+      buf[buffill++] = nib2hex(ctx.regs[r] & 0xf);
+      buf[buffill++] = ';';
+    }
+  }
+  memcpy_P(buf+buffill, PSTR("thread:1;"), 9);
+  buffill += 9;
 }
 
 void gdbSendState(byte signo)
 {
+#if STOPWATCH
+  sw.running = false; // if not yet recorded, the run does not count
+#endif
   targetSaveRegisters();
   gdbCheckRangeSteppingActive();
   switch (signo) {
@@ -3093,6 +4288,162 @@ void gdbMessage(const char pstr[],long num, boolean oprefix, boolean progmem)
 }
 
 
+#if DWPASSTHRU
+/****************** debugWIRE passthrough *************/
+
+// A frame from the host is PTESC, the number of operation bytes n (1..MAXBUF),
+// n operation bytes, and the 8-bit sum of the operation bytes. Each
+// operation is an opcode followed by its arguments (addresses little endian):
+//   PTRDSRAM/PTRDFLASH/PTRDEEPROM  addr16 len8          -> len bytes
+//   PTWRSRAM/PTWRFLASH/PTWREEPROM  addr16 len8 data     -> -
+//   PTRDREGS                       first8 len8          -> len bytes
+//   PTWRREGS                       first8 len8 data     -> -
+//      (registers 0-31 are r0-r31, 32 is SREG, 33/34 is SP low/high)
+//   PTGETPC                                             -> word address16
+//   PTSETPC                        waddr16              -> -
+//   PTEXEC                         opcode16             -> -
+//   PTSTEP                                              -> 1 if stopped again
+//   PTCONT                         runto16 (0xFFFF: HWBP of the GDB session, if any) -> -
+//   PTBREAK                                             -> 1 if stopped and calibrated
+//   PTPOLL                                              -> 1 if stopped, 0 if still running
+// The reply is PTESC, all results, a status byte (0 or the number of the
+// first failed operation; results of failed operations are zero-filled),
+// and the 8-bit sum of results and status. A frame with a wrong length or
+// checksum is answered by PTNAK only. Registers and PC are taken from the
+// register cache; memory operations and register access are only allowed
+// when the target is stopped.
+void ptHandleFrame(void)
+{
+  byte len, ix = 0, opnum = 0, status = 0, sum = 0, op, n = 0;
+  unsigned int arg, opcode, oparg;
+  boolean ok, flashwritten = false;
+  byte *mem;
+
+  measureRam();
+  len = gdbReadByte();
+  for (byte i = 0; i < len && i < MAXBUF; i++) {
+    buf[i] = gdbReadByte();
+    sum += buf[i];
+  }
+  if (gdbReadByte() != sum || len == 0 || len >= MAXBUF) {
+    gdbSendByte(PTNAK);
+    return;
+  }
+  sum = 0;
+  mem = buf + len; // scratch area for read results
+  gdbSendByte(PTESC);
+  while (ix < len) {
+    op = buf[ix++];
+    opnum++;
+    if (ix + (op <= PTWRREGS ? 3 : (op == PTSETPC || op == PTEXEC || op == PTCONT ? 2 : 0)) > len)
+      op = 0; // arguments missing: treat like an unknown operation
+    arg = buf[ix] + (buf[ix+1] << 8);
+    ok = (ctx.state == DWCONN_STATE && (ctx.saved || op == PTBREAK || op == PTPOLL));
+    switch (op) {
+    case PTRDSRAM: case PTRDFLASH: case PTRDEEPROM:
+    case PTWRSRAM: case PTWRFLASH: case PTWREEPROM:
+    case PTRDREGS: case PTWRREGS:
+      n = buf[ix+2];
+      ix += 3;
+      if (op & 1) { // read operations
+	if (n > MAXBUF - len) {
+	  ok = false;
+	  n = 0;
+	}
+	memset(mem, 0, n);
+      } else if (ix + n > len) {
+	ok = false;
+	ix = len;
+      }
+      if (!ok) break;
+      switch (op) {
+      case PTRDSRAM: targetReadSram(arg, mem, n); break;
+      case PTRDFLASH: targetReadFlash(arg, mem, n); gdbHideBREAKs(arg, mem, n); break;
+      case PTRDEEPROM: targetReadEeprom(arg, mem, n); break;
+      case PTWRSRAM: targetWriteSram(arg, &buf[ix], n); break;
+      case PTWRFLASH:
+	if (flashidle && !flashwritten) gdbUpdateBreakpoints(CLEANUP);
+	targetWriteFlash(arg, &buf[ix], n);
+	flashwritten = true;
+	break;
+      case PTWREEPROM: targetWriteEeprom(arg, &buf[ix], n); break;
+      case PTRDREGS: case PTWRREGS:
+	for (byte i = 0; i < n; i++) {
+	  byte r = (arg & 0xFF) + i;
+	  byte *loc = (r < 32 ? &ctx.regs[r] : (r == 32 ? &ctx.sreg : (r == 33 ? (byte *)&ctx.sp : (byte *)&ctx.sp + 1)));
+	  if (r > 34) ok = false;
+	  else if (op == PTRDREGS) mem[i] = *loc;
+	  else *loc = buf[ix+i];
+	}
+	break;
+      }
+      if (!(op & 1)) {
+	ix += n;
+	n = 0;
+      }
+      break;
+    case PTGETPC:
+      n = 2;
+      mem[0] = ctx.wpc & 0xFF;
+      mem[1] = ctx.wpc >> 8;
+      break;
+    case PTSETPC:
+      ix += 2;
+      if (ok) ctx.wpc = arg;
+      break;
+    case PTEXEC:
+      ix += 2;
+      if (!ok) break;
+      targetRestoreRegisters();
+      DWexecOffline(arg);
+      targetSaveRegisters();
+      break;
+    case PTSTEP: // an instruction hidden by a BREAK is executed offline as in gdbStep
+      n = 1;
+      if (!ok) break;
+      getInstruction(opcode, oparg);
+      mem[0] = ok = gdbStepInstruction(opcode, oparg);
+      break;
+    case PTCONT: // breakpoints are set as in gdbContinue, but the state stays DWCONN_STATE
+      ix += 2;
+      if (!ok) break;
+      if (flashwritten) targetFlushFlashProg();
+      flashwritten = false;
+      gdbUpdateBreakpoints(ASSIGN_ALL_BPS);
+      targetRestoreRegisters();
+      targetContinue(arg);
+      ptrunning = true; // GDB packets are refused until the target is stopped
+      break;
+    case PTBREAK:
+      n = 1;
+      if (!ok) break;
+      mem[0] = ok = targetBreakAndCalibrate();
+      if (ok) targetSaveRegisters();
+      break;
+    case PTPOLL:
+      n = 1;
+      mem[0] = ctx.saved;
+      if (!ok || ctx.saved || !dw.available()) break;
+      mem[0] = ok = expectBreakAndU();
+      if (ok) targetSaveRegisters();
+      break;
+    default:
+      ok = false;
+      ix = len; // cannot know the length of the arguments
+    }
+    if (!ok && status == 0) status = opnum;
+    for (byte i = 0; i < n; i++) {
+      gdbSendByte(ok ? mem[i] : 0);
+      sum += (ok ? mem[i] : 0);
+    }
+    n = 0;
+  }
+  if (flashwritten) targetFlushFlashProg();
+  gdbSendByte(status);
+  gdbSendByte(sum + status);
+}
+#endif
+
 /****************** target functions *************/
 
 // try to connect to debugWIRE by issuing a break condition
@@ -3120,7 +4471,12 @@ int targetISPConnect(void)
   unsigned int sig;
   int result = 0;
   
+#if FASTCONNECT
+  if (!enterProgramMode((ispspeedtype)sess.ispspeed)) return -CONNERR_NO_ISP_REPLY;
+  sess.ispspeed = ctx.ispspeed; // will be saved once we are in debugWIRE mode
+#else
   if (!enterProgramMode()) return -CONNERR_NO_ISP_REPLY;
+#endif
   sig = ispGetChipId();
   if (sig == 0)  // no reasonable signature
     result = -CONNERR_NO_ISP_REPLY;
@@ -3132,14 +4488,16 @@ int targetISPConnect(void)
     if (mon.nolockbits) 
       result = -CONNERR_LOCK_BITS_NOT_MANAGED;
     if (!result) {
-      ispEraseFlash(); // erase flash mem and lock bits
-      _delay_ms(1000);
+      if (!ispEraseFlash()) // erase flash mem and lock bits
+	result = -CONNERR_CANNOT_CLEAR_LOCK_BITS;
+      else
+	_delay_ms(1000);
     }
   }
   leaveProgramMode();
   _delay_ms(200);
   if (result) return result;
-  enterProgramMode();
+  enterProgramMode(ctx.ispspeed);
   if (ispLocked()) 
     result = -CONNERR_CANNOT_CLEAR_LOCK_BITS;
   if (!result && !mon.nobootrst && mcu.bootrstmask)  // here we disable the bootloader-vector fuse BOOTRST if existent and allowed
@@ -3225,6 +4583,16 @@ void targetReadFlashPage(unsigned int addr)
     reportFatalError(READ_PAGE_ADDR_FATAL, false);
     return;
   }
+#if FLASHPIPE
+  targetPipeFinish(); // 'page' may still hold a page to be programmed
+#endif
+#if FASTLOAD
+  if (fl.installed && addr == fl.stubaddr) { // original contents are in SRAM
+    DWreadSramBytes(mcu.rambase+mcu.pagesz, page, mcu.pagesz);
+    validpg = false;
+    return;
+  }
+#endif
   if (!validpg || (lastpg != addr)) {
     targetReadFlash(addr, page, mcu.targetpgsz);
     lastpg = addr;
@@ -3234,6 +4602,34 @@ void targetReadFlashPage(unsigned int addr)
   }
 }
 
+// like targetReadFlashPage, but give up after FLASHHEAD bytes if these
+// already show that newpage cannot be programmed without erasing the page;
+// returns true if 'page' holds the complete old contents
+boolean targetReadFlashPageUnlessDirty(unsigned int addr)
+{
+  byte i;
+
+  if ((validpg && lastpg == addr) || mcu.targetpgsz <= FLASHHEAD
+#if FASTLOAD
+      || (fl.installed && addr == fl.stubaddr)
+#endif
+      ) {
+    targetReadFlashPage(addr);
+    return true;
+  }
+#if FLASHPIPE
+  targetPipeFinish();
+#endif
+  validpg = false;
+  targetReadFlash(addr, page, FLASHHEAD);
+  for (i = 0; i < FLASHHEAD; i++)
+    if (~page[i] & newpage[i]) return false;
+  targetReadFlash(addr + FLASHHEAD, page + FLASHHEAD, mcu.targetpgsz - FLASHHEAD);
+  lastpg = addr;
+  validpg = true;
+  return true;
+}
+
 // read one word of flash (must be an even address!)
 unsigned int targetReadFlashWord(unsigned int addr)
 {
@@ -3330,8 +4726,9 @@ void targetReadEeprom(unsigned int addr, byte *mem, unsigned int len)
 // and finally write page
 // remember page content in 'page' buffer
 // if the MCU use the 4-page erase operation, then
-// do 4 load/program cycles for the 4 sub-pages
-void targetWriteFlashPage(unsigned int addr)
+// do 4 load/program cycles for the 4 sub-pages;
+// if 'later' is true, the page may be programmed by targetPipeProgram instead 
+void targetWriteFlashPage(unsigned int addr, __attribute__((unused)) boolean later)
 {
   byte subpage;
   boolean dirty = true;
@@ -3349,10 +4746,20 @@ void targetWriteFlashPage(unsigned int addr)
     reportFatalError(WRITE_PAGE_ADDR_FATAL, false);
     return;
   }
+#if FLASHPIPE
+  targetPipeFinish();
+#endif
+#if FASTLOAD
+  if (fl.installed && addr == fl.stubaddr) { // will be written when the loader is removed
+    DWwriteSramBytes(mcu.rambase+mcu.pagesz, newpage, mcu.pagesz);
+    validpg = false;
+    return;
+  }
+#endif
   DWreenableRWW();
-  if (mon.readbeforewrite) {
-    // read old page contents (maybe from page cache)
-    targetReadFlashPage(addr);
+  // read old page contents (maybe from page cache), unless the first bytes
+  // already show that the page has to be erased
+  if (mon.readbeforewrite && targetReadFlashPageUnlessDirty(addr)) {
     // check whether something changed
     // DEBPR(F("Check for change: "));
     if (memcmp(newpage, page, mcu.targetpgsz) == 0) {
@@ -3384,7 +4791,23 @@ void targetWriteFlashPage(unsigned int addr)
       }
   }
   validpg = false;
+#if FLASHPIPE
+  if (later && basebps >= PIPEMINBPS
+#if FASTLOAD
+      && !fl.installed
+#endif
+      ) {
+    memcpy(page, newpage, mcu.targetpgsz); // 'page' is the second page buffer now
+    pipe.addr = addr;
+    pipe.dirty = dirty;
+    pipe.pending = true;
+    return;
+  }
+#endif
   
+#if FASTLOAD
+  if (!fl.installed || fl.unusable || !targetFastWritePage(addr, dirty)) {
+#endif
   // erase page when dirty
   if (dirty) DWeraseFlashPage(addr);
     
@@ -3405,6 +4828,9 @@ void targetWriteFlashPage(unsigned int addr)
     DWprogramFlashPage(addr+subpage*mcu.pagesz);
     DWreenableRWW();
   }
+#if FASTLOAD
+  } else if (fatalerror || targetOffline()) return; // newpage may hold the restored loader page
+#endif
 
   if (mon.verifyload) {
     // read back last programmed page and compare
@@ -3420,6 +4846,74 @@ void targetWriteFlashPage(unsigned int addr)
   }
 }
 
+#if FASTLOAD
+// Put the flash loader into the smallest boot section (or the last page
+// if there is none) and save the original contents in target SRAM;
+// nothing happens if the MCU is not suitable
+void targetInstallFlashStub(void)
+{
+  if (fl.unusable || mcu.erase4pg || mcu.pagesz < sizeof(flashstub) || mcu.ramsz < 2*mcu.pagesz)
+    return;
+  fl.stubaddr = (mcu.bootaddr ? mcu.bootaddr*2 : mcu.flashsz - mcu.pagesz);
+  targetReadFlashPage(fl.stubaddr);
+  DWwriteSramBytes(mcu.rambase+mcu.pagesz, page, mcu.pagesz);
+  memset(newpage, 0xFF, mcu.pagesz);
+  memcpy_P(newpage, flashstub, sizeof(flashstub));
+  targetWriteFlashPage(fl.stubaddr);
+  fl.installed = (fatalerror == NO_FATAL);
+}
+
+// restore the page that was used for the loader
+void targetRemoveFlashStub(void)
+{
+  fl.pages = 0;
+  if (!fl.installed) return;
+  fl.installed = false;
+  DWreadSramBytes(mcu.rambase+mcu.pagesz, newpage, mcu.pagesz);
+  targetWriteFlashPage(fl.stubaddr);
+}
+
+// write newpage using the loader: the page goes into SRAM at rambase as a
+// block, registers are set up, and the loader runs until its BREAK;
+// the registers are restored from ctx before the target is started again.
+// Outside a boot section, SPM does nothing unless SELFPRGEN is programmed,
+// so the first page of a session is read back; returns false if the loader
+// cannot be used and the page has to be written over debugWIRE
+boolean targetFastWritePage(unsigned int addr, boolean dirty)
+{
+  byte regs[] = { (byte)(dirty ? 0x03 : 0), 0x05, 0x01,       // r20-r22: PGERS, PGWRT, SPMEN
+		  (byte)(mcu.bootaddr ? 0x11 : 0),             // r23: RWWSRE
+		  (byte)(mcu.pagesz/2), 0,                     // r24: number of words
+		  (byte)(mcu.rambase & 0xFF), (byte)(mcu.rambase >> 8), // X: data in SRAM
+		  0, 0,
+		  (byte)(addr & 0xFF), (byte)(addr >> 8) };    // Z: page address
+  measureRam();
+  DWwriteSramBytes(mcu.rambase, newpage, mcu.pagesz);
+  DWwriteRegisterRange(20, regs, sizeof(regs));
+  DWwriteIOreg(0x3F, 0); // no interrupts while the loader runs
+  DWflushInput();
+  dw.sendCmd((byte)(0x60&mon.tmask));
+  DWsetWPc(fl.stubaddr/2);
+  dw.sendCmd(0x30, true);
+  if (!expectBreakAndU()) {
+    reportFatalError(FLASH_PROGRAM_FATAL, true);
+    if (!targetOffline()) targetRemoveFlashStub(); // the only copy of the page is in target SRAM
+    return true;
+  }
+  if (!fl.checked) {
+    DWreadFlash(addr, page, mcu.pagesz);
+    if (memcmp(page, newpage, mcu.pagesz) != 0) {
+      fl.unusable = true;
+      return false;
+    }
+    fl.checked = true;
+  }
+  if (dirty) erasecnt++;
+  flashcnt++;
+  return true;
+}
+#endif
+
 // write some chunk of data to flash in a lazy way:
 // - if empty length, write active page to flash and return
 // - if a new byte to be written leaves the current page, write the page before anything else
@@ -3434,7 +4928,10 @@ void targetWriteFlash(unsigned int addr, byte *mem, unsigned int len)
   measureRam();
 
   if (len == 0) {
-    if (!flashidle) targetWriteFlashPage(flashpageaddr);
+    if (!flashidle) {
+      targetFillFlashPage(flashpageaddr);
+      targetWriteFlashPage(flashpageaddr);
+    }
     flashidle = true;
     return;
   }
@@ -3442,26 +4939,136 @@ void targetWriteFlash(unsigned int addr, byte *mem, unsigned int len)
   for (ix = 0; ix < len; ix++) {
     newaddr = addr + ix;
     if ((newaddr < flashpageaddr || newaddr > flashpageaddr + mcu.targetpgsz - 1) && !flashidle) {
-      targetWriteFlashPage(flashpageaddr);
+      targetFillFlashPage(flashpageaddr);
+      targetWriteFlashPage(flashpageaddr, true);
       flashidle = true;
     }
     if (flashidle) {
+#if FASTLOAD
+      if (fl.installed && fl.unusable) targetRemoveFlashStub(); // loader cannot program
+      if (!fl.installed && fl.pages++ == 1) targetInstallFlashStub(); // only worthwhile for more than one page
+#endif
       flashpageaddr = newaddr & ~(mcu.targetpgsz-1);
-      targetReadFlashPage(flashpageaddr);
-      memcpy(newpage, page, mcu.targetpgsz);
+#if FLASHPIPE
+      if (pipe.pending && pipe.addr == flashpageaddr) // flash is not up to date yet
+	targetPipeFinish();
+#endif
+      memset(pgmask, 0, sizeof(pgmask)); // old contents are only read for what is not covered
       flashidle = false;
     }
     newpage[newaddr-flashpageaddr] = mem[ix];
+    PGCOVER(newaddr-flashpageaddr);
+  }
+}
+
+// fill the bytes of newpage that the host has not supplied with the current
+// flash contents; only the gaps are read, unless the page is cached anyway
+// or there are so many gaps that reading the whole page is cheaper
+void targetFillFlashPage(unsigned int addr)
+{
+  unsigned int i, j;
+  byte gaps = 0;
+
+  measureRam();
+  for (i = 0; i < mcu.targetpgsz; i++)
+    if (!PGCOVERED(i) && (i == 0 || PGCOVERED(i-1))) gaps++;
+  if (gaps == 0) return; // the usual case for a sequential load
+  if (gaps > 2 || (validpg && lastpg == addr)
+#if FASTLOAD
+      || (fl.installed && addr == fl.stubaddr)
+#endif
+      ) {
+    targetReadFlashPage(addr);
+    for (i = 0; i < mcu.targetpgsz; i++)
+      if (!PGCOVERED(i)) newpage[i] = page[i];
+    return;
+  }
+  for (i = 0; i < mcu.targetpgsz; i = j) {
+    if (PGCOVERED(i)) {
+      j = i + 1;
+      continue;
+    }
+    for (j = i; j < mcu.targetpgsz && !PGCOVERED(j); j++);
+    targetReadFlash(addr + i, &newpage[i], j - i);
   }
 }
 
-// flush any bytes that still have to be written to flash memory
-inline void targetFlushFlashProg(void)
+// flush any bytes that still have to be written to flash memory;
+// the loader is only removed if the load is done
+inline void targetFlushFlashProg(__attribute__((unused)) boolean done)
 {
-  targetWriteFlash(0, membuf, 0);
+  targetWriteFlash(0, NULL, 0);
+#if FLASHPIPE
+  targetPipeFinish();
+#endif
+#if FASTLOAD
+  if (done) targetRemoveFlashStub();
+#endif
   mon.noread = false; // reset noread flag after one load!
 }
 
+#if FLASHPIPE
+// program the pending page from 'page'; if 'overlap' is true, the reply to the
+// last packet has been sent and the host may be sending the next one, which
+// is then collected by gdbPrefetchInput between the DW transactions
+void targetPipeProgram(boolean overlap)
+{
+  byte subpage;
+  unsigned int i;
+
+  if (!pipe.pending) return;
+  pipe.pending = false;
+  if (overlap) {
+    if (pipe.next < pipe.fill) { // keep what has not been read yet
+      memmove(buf, buf + pipe.next, pipe.fill - pipe.next);
+      pipe.fill -= pipe.next;
+    } else pipe.fill = 0;
+    pipe.next = 0;
+    pipe.draining = true;
+    gdbPrefetchInput();
+  }
+  if (pipe.dirty) DWeraseFlashPage(pipe.addr);
+  DWreenableRWW();
+  for (i = 0; i < mcu.targetpgsz && page[i] == 0xFF; i++);
+  if (i < mcu.targetpgsz) { // not empty
+    for (subpage = 0; subpage < 1+(3*mcu.erase4pg); subpage++) {
+      DWloadFlashPageBuffer(pipe.addr+(subpage*mcu.pagesz), &page[subpage*mcu.pagesz]);
+      DWprogramFlashPage(pipe.addr+subpage*mcu.pagesz);
+      DWreenableRWW();
+    }
+  }
+  pipe.draining = false;
+  lastpg = pipe.addr;
+  pipe.verify = mon.verifyload; // reading back takes too long to leave the UART alone
+  validpg = !pipe.verify;
+}
+
+// finish the pending page (if any) while the host waits for a reply;
+// verification compares small chunks, because 'newpage' may be in use 
+void targetPipeFinish(void)
+{
+  byte chunk[16];
+  unsigned int i;
+
+  if (pipe.slow) { // now the second calibration cannot cause a UART overrun
+    pipe.slow = false;
+    blockIRQ();
+    if (!DWspeedUp()) reportFatalError(DW_TIMEOUT_FATAL, true);
+  }
+  targetPipeProgram(false);
+  if (!pipe.verify) return;
+  pipe.verify = false;
+  for (i = 0; i < mcu.targetpgsz; i += sizeof(chunk)) {
+    DWreadFlash(pipe.addr + i, chunk, sizeof(chunk));
+    if (memcmp(chunk, &page[i], sizeof(chunk)) != 0) {
+      reportFatalError(FLASH_VERIFY_FATAL, false);
+      return;
+    }
+  }
+  validpg = true;
+}
+#endif
+
 // write SRAM chunk
 // skip read-only I/O registers
 void targetWriteSram(unsigned int addr, byte *mem, unsigned int len)
@@ -3472,6 +5079,10 @@ void targetWriteSram(unsigned int addr, byte *mem, unsigned int len)
   const byte *mask = mcu.maskregs;
   byte mask_reg = 0;
 
+#if FASTLOAD
+  if (fl.installed) targetFlushFlashProg(); // target SRAM holds the original loader page
+#endif
+
   if (addr > 0xFF) { // if in SRAM, simply write
     while (offset < len) {
     DWwriteSramByte(addr+offset, mem[offset]);
@@ -3555,6 +5166,154 @@ void targetRestoreRegisters(void)
   ctx.saved = false; // now, we can save them again and be sure to get the right values
 }
 
+#if SEMIHOSTING
+// Check whether the target stopped at a semihosting BREAK, i.e., a BREAK
+// in the program (not a breakpoint) with r21:r20 = SHMAGIC,
+// r25:r24 = buffer address, and r22 = number of bytes.
+// If so, forward the buffer as 'O' packets and continue execution behind the BREAK.
+// Otherwise, leave everything as it was and return false.
+boolean targetSemihosting(void)
+{
+  unsigned int wpc, addr;
+  byte regs[12]; // r20 - r31
+  byte len, chunk, i, b, *mem;
+
+  measureRam();
+  wpc = DWgetWPc(true);               // first, because the PC is used as a counter by the other commands
+  DWreadRegisterRange(20, regs, 12);
+  if (regs[0] != (SHMAGIC & 0xFF) || regs[1] != (SHMAGIC >> 8) || 
+      wpc == hwbp || gdbFindBreakpoint(wpc) >= 0 ||
+      targetReadFlashWord(wpc*2) != BREAKCODE) {
+    DWwriteRegisterRange(28, &regs[8], 4); // flash read clobbers Y and Z
+    DWsetWPc(wpc+1);                  // so that targetSaveRegisters gets the right PC
+    return false;
+  }
+  addr = regs[4] | (regs[5] << 8);
+  len = regs[2];
+  while (len) {
+    chunk = (len > (MAXBUF-1)/2 ? (MAXBUF-1)/2 : len);
+    mem = buf + MAXBUF - chunk; // converted in place as in gdbReadMemory
+    DWreadSramBytes(addr, mem, chunk);
+    buf[0] = 'O';
+    for (i = 0; i < chunk; i++) {
+      b = mem[i];
+      buf[i*2 + 1] = nib2hex(b >> 4);
+      buf[i*2 + 2] = nib2hex(b & 0xf);
+    }
+    gdbSendBuff(buf, chunk*2 + 1);
+    addr += chunk;
+    len -= chunk;
+  }
+  DWwriteRegisterRange(28, &regs[8], 4); // restore Y and Z
+  ctx.wpc = wpc + 1;                   // continue behind the BREAK
+  targetContinue(contrunto);           // keeping the range stepping target
+  return true;
+}
+#endif
+
+#if TIMEBASE
+// Stop the target asynchronously for a short look at it and return its PC in wpc.
+// No registers are saved, so the caller has to restore everything it clobbers
+// and let the target continue using targetContinue(contrunto).
+// Returns false if the stop had to be reported to GDB instead.
+boolean targetPause(unsigned int &wpc)
+{
+  measureRam();
+  if (!targetBreakAndCalibrate()) {
+    gdbSendState(SIGHUP);
+    return false;
+  }
+  wpc = DWgetWPc(true);
+  if (wpc == hwbp) {    // we might have raced with the HWBP
+    DWsetWPc(wpc+1);
+    gdbSendState(SIGTRAP);
+    return false;
+  }
+  ctx.wpc = wpc;       // a BREAK at wpc will be executed again
+  return true;
+}
+
+// let the target continue after targetPause, which was called at time start,
+// and return the time the target has been stopped (in Timer2 ticks)
+unsigned long targetResume(unsigned long start)
+{
+  unsigned long stopped;
+  
+  targetContinue(contrunto);
+  stopped = timebaseTicks() - start;
+#if STOPWATCH
+  sw.paused += stopped;
+#endif
+  return stopped;
+}
+#endif
+
+#if SAMPLING
+// Stop the target, read the sampled SRAM regions, and let the target continue.
+// Only Z is saved and restored (clobbered by reading SRAM), the PC is
+// set again by targetContinue. The sample is sent as an 'O' packet, which is
+// a line consisting of the time stamp in us (8 hex digits), a colon, and
+// the sampled bytes (2 hex digits each).
+void targetSample(void)
+{
+  unsigned long start, us;
+  unsigned int wpc;
+  byte z[2], data[MAXSAMPLE];
+  byte i, n = 0, line[10 + 2*MAXSAMPLE];
+
+  measureRam();
+  start = timebaseTicks();
+  if (!targetPause(wpc)) return;
+  DWreadRegisterRange(30, z, 2);
+  for (i = 0; i < smp.num; i++) {
+    DWreadSramBytes(smp.addr[i], &data[n], smp.len[i]);
+    n += smp.len[i];
+  }
+  DWwriteRegisterRange(30, z, 2);
+  smp.stopped += targetResume(start);
+  smp.last = start;
+  smp.cnt++;
+  us = TICKS2US(start);
+  for (i = 0; i < 8; i++) line[i] = nib2hex((us >> (28 - 4*i)) & 0xF);
+  line[8] = ':';
+  for (i = 0; i < n; i++) {
+    line[9 + 2*i] = nib2hex(data[i] >> 4);
+    line[10 + 2*i] = nib2hex(data[i] & 0xF);
+  }
+  line[9 + 2*n] = '\n';
+  buf[0] = 'O';
+  for (i = 0; i < 10 + 2*n; i++) {
+    buf[1 + 2*i] = nib2hex(line[i] >> 4);
+    buf[2 + 2*i] = nib2hex(line[i] & 0xF);
+  }
+  gdbSendBuff(buf, 1 + 2*(10 + 2*n));
+}
+#endif
+
+#if PROFILING
+// Stop the target, read the PC, and let the target continue.
+// Since only the PC is read, no register needs to be restored.
+void targetProfile(void)
+{
+  unsigned long start, baddr;
+  unsigned int wpc, bucket;
+
+  measureRam();
+  start = timebaseTicks();
+  if (!targetPause(wpc)) return;
+  prof.stopped += targetResume(start);
+  prof.last = start;
+  prof.cnt++;
+  baddr = (unsigned long)wpc << 1;
+  bucket = (baddr - prof.start) >> prof.shift;
+  if (baddr < prof.start || bucket >= PROFBUCKETS) {
+    if (prof.other < 0xFFFF) prof.other++;
+  } else if (prof.hist[bucket] < 0xFFFF) {
+    prof.hist[bucket]++;
+  }
+}
+#endif
+
 // send break in order to stop execution asynchronously
 void targetBreak(void)
 {
@@ -3562,12 +5321,28 @@ void targetBreak(void)
   dw.sendBreak(); // send the break
 }
 
+// stop the target with a break that is only 20 bit times long at the speed
+// the target falls back to after a break (not the sped-up ctx.bps) and
+// recalibrate; use the long break if that speed is unknown or there is no
+// 0x55 response within a few frame times
+boolean targetBreakAndCalibrate(void)
+{
+  measureRam();
+  if (basebps) {
+    dw.sendBreak(basebps);
+    if (expectUCalibrate(SHORTBREAKWAIT(basebps))) return true;
+  }
+  targetBreak();
+  return expectUCalibrate();
+}
+
 // start to execute
 // if runto == 0xFFFF, then consider hwbp as a possible target (if != 0xFFFF)
 // otherwise the runto parameter has precedence 
 void targetContinue(unsigned int runto)
 {
   measureRam();
+  contrunto = runto;
 
   if (hwbp != 0xFFFF || runto != 0xFFFF) {
     dw.sendCmd((byte)(0x61&mon.tmask));
@@ -3577,6 +5352,13 @@ void targetContinue(unsigned int runto)
   }
   DWsetWPc(ctx.wpc);
   dw.sendCmd(0x30, true); // return during sending the stop bit so that nothing surprises us
+#if STOPWATCH
+  if (!sw.running) {
+    sw.start = timebaseTicks();
+    sw.paused = 0;
+    sw.running = true;
+  }
+#endif
 }
 
 // make a single step
@@ -3618,6 +5400,14 @@ boolean doBreak (boolean doprinterror = true) {
   pinMode(DWLINE, INPUT);
   _delay_ms(10);
   ctx.bps = 0; // forget about previous connection
+  basebps = 0;
+#if FASTCONNECT
+  if (sess.sig && sess.bps) { // try a short break at the remembered speed first
+    dw.sendBreak(sess.bps);
+    if (expectUCalibrate(SHORTBREAKWAIT(sess.bps))) return true;
+    ctx.bps = 0;
+  }
+#endif
   dw.sendBreak(); // send a break
 #if SCOPEDEBUG
   PORTD|=(1<<PD3);
@@ -3643,14 +5433,13 @@ boolean doBreak (boolean doprinterror = true) {
 // re-calibrate on a sent 0x55, then try to set the highest possible speed, i.e.,
 // multiply speed by at most 16 up to 250k baud - provided we have another speed than
 // before
-// return false if syncing was unsuccessful
-boolean expectUCalibrate(void) {
-  int8_t speed;
+// return false if syncing was unsuccessful or no 0x55 arrived within maxwait us
+boolean expectUCalibrate(unsigned long maxwait) {
   unsigned long newbps;
 
   measureRam();
   blockIRQ();
-  newbps = dw.calibrate(); // expect 0x55 and calibrate
+  newbps = dw.calibrate(maxwait); // expect 0x55 and calibrate
   //DEBPR(F("Rsync (1): ")); DEBLN(newbps);
   if (newbps < 5) {
     ctx.bps = 0;
@@ -3663,8 +5452,26 @@ boolean expectUCalibrate(void) {
     return true;
   }
   dw.begin(newbps);
+  basebps = newbps;
+#if FLASHPIPE
+  if (pipe.draining) { // the host is sending: keep the interrupts off as briefly as possible
+    ctx.bps = newbps;  // and speed up later in targetPipeFinish
+    pipe.slow = true;
+    unblockIRQ();
+    return true;
+  }
+#endif
+  return DWspeedUp();
+}
+
+// set the highest possible DW speed for basebps, i.e., multiply it by at most 16
+// up to the speed limit; has to be called with blocked IRQs, which are unblocked
+boolean DWspeedUp(void)
+{
+  int8_t speed;
+
   for (speed = maxspeedexp; speed > 0; speed--) {
-    if ((newbps << speed) <= speedlimit) break;
+    if ((basebps << speed) <= speedlimit) break;
   }
   //DEBPR(F("Set speedexp: ")); DEBLN(speed);
 #if CONSTDWSPEED == 0
@@ -3677,7 +5484,7 @@ boolean expectUCalibrate(void) {
     return false; // too slow
   }
 #else
-  ctx.bps = newbps;
+  ctx.bps = basebps;
 #endif
   dw.begin(ctx.bps);
   return true;
@@ -3690,7 +5497,12 @@ boolean expectBreakAndU(void)
   byte cc;
   
   // wait first for a zero byte
-  while (!dw.available() && timeout != 0) timeout--;
+  while (!dw.available() && timeout != 0) {
+#if FLASHPIPE
+    if (pipe.draining) gdbPrefetchInput();
+#endif
+    timeout--;
+  }
   if (timeout == 0) {
     //DEBLN(F("Timeout in expectBreakAndU"));
     return false;
@@ -3723,10 +5535,12 @@ unsigned int getResponse (byte *data, unsigned int expected) {
       data[idx++] = dw.read();
       timeout = 0;
       if (expected > 0 && idx == expected) {
+        dwrcvd += expected;
         return expected;
       }
     }
   } while (timeout++ < 20000);
+  dwrcvd += idx;
   if (expected > 0) {
     //DEBPR(F("Timeout: received: "));
     //DEBPR(idx);
@@ -3776,25 +5590,25 @@ void DWsetSpeed(byte spix)
 //  in r0 as <xx> by sending it to the DWDR register.
 
 // Build high byte of opcode for "out addr, reg" instruction
-byte outHigh (byte add, byte reg) {
+DWINLINE byte outHigh (byte add, byte reg) {
   // out addr,reg: 1011 1aar rrrr aaaa
   return 0xB8 + ((reg & 0x10) >> 4) + ((add & 0x30) >> 3);
 }
 
 // Build low byte of opcode for "out addr, reg" instruction
-byte outLow (byte add, byte reg) {
+DWINLINE byte outLow (byte add, byte reg) {
   // out addr,reg: 1011 1aar rrrr aaaa
   return (reg << 4) + (add & 0x0F);
 }
 
 // Build high byte of opcode for "in reg,addr" instruction
-byte inHigh  (byte add, byte reg) {
+DWINLINE byte inHigh  (byte add, byte reg) {
   // in reg,addr:  1011 0aar rrrr aaaa
   return 0xB0 + ((reg & 0x10) >> 4) + ((add & 0x30) >> 3);
 }
 
 // Build low byte of opcode for "in reg,addr" instruction
-byte inLow  (byte add, byte reg) {
+DWINLINE byte inLow  (byte add, byte reg) {
   // in reg,addr:  1011 0aar rrrr aaaa
   measureRam();
 
@@ -3803,43 +5617,58 @@ byte inLow  (byte add, byte reg) {
 
 // Write all registers 
 void DWwriteRegisters(byte *regs)
+{
+  DWwriteRegisterRange(0, regs, 32);
+}
+
+// Write <num> registers starting with register <first>
+void DWwriteRegisterRange(byte first, byte *regs, byte num)
 {
   byte wrRegs[] = {(byte)(0x66&mon.tmask),              // read/write
-		   0xD0, mcu.stuckat1byte, 0x00,        // start reg
-		   0xD1, mcu.stuckat1byte, 0x20,        // end reg
+		   0xD0, MCUSTUCK, first,       // start reg
+		   0xD1, MCUSTUCK, (byte)(first+num), // end reg
 		   0xC2, 0x05,                          // write registers
 		   0x20 };                              // go
   measureRam();
   dw.sendCmd(wrRegs,  sizeof(wrRegs));
-  dw.sendCmd(regs, 32);
+  dw.sendCmd(regs, num);
 }
 
 // Set register <reg> by building and executing an "in <reg>,DWDR" instruction via the CMD_SET_INSTR register
 void DWwriteRegister (byte reg, byte val) {
   byte wrReg[] = {(byte)(0x64&mon.tmask),                                  // Set up for single step using loaded instruction
-                  0xD2, inHigh(mcu.dwdr, reg), inLow(mcu.dwdr, reg), 0x23, // Build "in reg,DWDR" instruction
+                  0xD2, inHigh(MCUDWDR, reg), inLow(MCUDWDR, reg), 0x23, // Build "in reg,DWDR" instruction
                   val};                                                    // Write value to register via DWDR
   measureRam();
+#if FLASHPIPE
+  if (pipe.draining) gdbPrefetchInput();
+#endif
 
   dw.sendCmd(wrReg,  sizeof(wrReg));
 }
 
 // Read all registers
 void DWreadRegisters (byte *regs)
+{
+  DWreadRegisterRange(0, regs, 32);
+}
+
+// Read <num> registers starting with register <first>
+void DWreadRegisterRange (byte first, byte *regs, byte num)
 {
   int response;
   byte rdRegs[] = {(byte)(0x66&mon.tmask),
-		   0xD0, mcu.stuckat1byte, 0x00, // start reg
-		   0xD1, mcu.stuckat1byte, 0x20, // end reg
-		   0xC2, 0x01};                  // read registers
+		   0xD0, MCUSTUCK, first,             // start reg
+		   0xD1, MCUSTUCK, (byte)(first+num), // end reg
+		   0xC2, 0x01};                               // read registers
   measureRam();
   DWflushInput();
   dw.sendCmd(rdRegs,  sizeof(rdRegs));
   blockIRQ();
   dw.sendCmd(0x20, true);         // Go
-  response = getResponse(regs, 32);
+  response = getResponse(regs, num);
   unblockIRQ();
-  if (response != 32) reportFatalError(DW_READREG_FATAL,true);
+  if (response != num) reportFatalError(DW_READREG_FATAL,true);
 }
 
 // Read register <reg> by building and executing an "out DWDR,<reg>" instruction
@@ -3849,7 +5678,7 @@ byte DWreadRegister (byte reg, bool checkdwdr) {
   int response;
   byte res = 0;
   byte rdReg[] = {(byte)(0x64&mon.tmask),                               // Set up for single step using loaded instruction
-                  0xD2, outHigh(mcu.dwdr, reg), outLow(mcu.dwdr, reg)}; // Build "out DWDR, reg" instruction
+                  0xD2, outHigh(MCUDWDR, reg), outLow(MCUDWDR, reg)}; // Build "out DWDR, reg" instruction
   measureRam();
   DWflushInput();
   dw.sendCmd(rdReg,  sizeof(rdReg));
@@ -3867,13 +5696,13 @@ byte DWreadRegister (byte reg, bool checkdwdr) {
 // Write one byte to SRAM address space using an SRAM-based value for <addr>, not an I/O address
 void DWwriteSramByte (unsigned int addr, byte val) {
   byte wrSram[] = {(byte)(0x66&mon.tmask),                           // Set up for read/write 
-                   0xD0, mcu.stuckat1byte, 0x1E,                      // Set Start Reg number (r30)
-                   0xD1, mcu.stuckat1byte, 0x20,                      // Set End Reg number (r31) + 1
+                   0xD0, MCUSTUCK, 0x1E,                      // Set Start Reg number (r30)
+                   0xD1, MCUSTUCK, 0x20,                      // Set End Reg number (r31) + 1
                    0xC2, 0x05,                                        // Set repeating copy to registers via DWDR
                    0x20,                                              // Go
 		   (byte)(addr & 0xFF), (byte)(addr >> 8),            // r31:r30 (Z) = addr
-                   0xD0, mcu.stuckat1byte, 0x01,
-                   0xD1, mcu.stuckat1byte, 0x03,
+                   0xD0, MCUSTUCK, 0x01,
+                   0xD1, MCUSTUCK, 0x03,
                    0xC2, 0x04,                                        // Set simulated "in r?,DWDR; st Z+,r?" instructions
                    0x20,                                              // Go
                    val};
@@ -3882,11 +5711,32 @@ void DWwriteSramByte (unsigned int addr, byte val) {
   dw.sendCmd(wrSram, sizeof(wrSram));
 }
 
+#if FASTLOAD
+// Write <len> bytes to SRAM as one block
+void DWwriteSramBytes (unsigned int addr, const byte *mem, byte len) {
+  unsigned int len2 = len * 2 + 1;
+  byte wrSram[] = {(byte)(0x66&mon.tmask),                           // Set up for read/write 
+                   0xD0, MCUSTUCK, 0x1E,                      // Set Start Reg number (r30)
+                   0xD1, MCUSTUCK, 0x20,                      // Set End Reg number (r31) + 1
+                   0xC2, 0x05,                                        // Set repeating copy to registers via DWDR
+                   0x20,                                              // Go
+		   (byte)(addr & 0xFF), (byte)(addr >> 8),            // r31:r30 (Z) = addr
+                   0xD0, MCUSTUCK, 0x01,
+                   0xD1, (byte)((len2 >> 8)+MCUSTUCK), (byte)(len2 & 0xFF), // Set repeat count = len * 2 + 1
+                   0xC2, 0x04,                                        // Set simulated "in r?,DWDR; st Z+,r?" instructions
+                   0x20};                                             // Go
+  measureRam();
+  DWflushInput();
+  dw.sendCmd(wrSram, sizeof(wrSram));
+  dw.sendCmd(mem, len);
+}
+#endif
+
 // Write one byte to IO register (via R0)
 void DWwriteIOreg (byte ioreg, byte val)
 {
   byte wrIOreg[] = {(byte)(0x64&mon.tmask),                                // Set up for single step using loaded instruction
-		    0xD2, inHigh(mcu.dwdr, 0), inLow(mcu.dwdr, 0), 0x23,    // Build "in reg,DWDR" instruction
+		    0xD2, inHigh(MCUDWDR, 0), inLow(MCUDWDR, 0), 0x23,    // Build "in reg,DWDR" instruction
 		    val,                                                // load val into r0
 		    0xD2, outHigh(ioreg, 0), outLow(ioreg, 0),          // now store from r0 into ioreg
 		    0x23};
@@ -3904,13 +5754,13 @@ byte DWreadSramByte (unsigned int addr) {
 #else
   unsigned int response;
   byte rdSram[] = {(byte)(0x66&mon.tmask),                            // Set up for read/write 
-                   0xD0, mcu.stuckat1byte, 0x1E,                      // Set Start Reg number (r30)
-                   0xD1, mcu.stuckat1byte, 0x20,                      // Set End Reg number (r31) + 1
+                   0xD0, MCUSTUCK, 0x1E,                      // Set Start Reg number (r30)
+                   0xD1, MCUSTUCK, 0x20,                      // Set End Reg number (r31) + 1
                    0xC2, 0x05,                                        // Set repeating copy to registers via DWDR
                    0x20,                                              // Go
                    (byte)(addr & 0xFF), (byte)(addr >> 8),            // r31:r30 (Z) = addr
-                   0xD0, mcu.stuckat1byte, 0x00,                                  // 
-                   0xD1, mcu.stuckat1byte, 0x02,                                  // 
+                   0xD0, MCUSTUCK, 0x00,                                  // 
+                   0xD1, MCUSTUCK, 0x02,                                  // 
                    0xC2, 0x00};                                        // Set simulated "ld r?,Z+; out DWDR,r?" instructions
   measureRam();
   DWflushInput();
@@ -3932,7 +5782,7 @@ byte DWreadIOreg (byte ioreg)
   byte rdIOreg[] = {(byte)(0x64&mon.tmask),                            // Set up for single step using loaded instruction
 		    0xD2, inHigh(ioreg, 0), inLow(ioreg, 0),           // Build "out DWDR, reg" instruction
 		    0x23,
-		    0xD2, outHigh(mcu.dwdr, 0), outLow(mcu.dwdr, 0)};  // Build "out DWDR, 0" instruction
+		    0xD2, outHigh(MCUDWDR, 0), outLow(MCUDWDR, 0)};  // Build "out DWDR, 0" instruction
   measureRam();
   DWflushInput();
   dw.sendCmd(rdIOreg, sizeof(rdIOreg));
@@ -3946,17 +5796,23 @@ byte DWreadIOreg (byte ioreg)
 
 // Read <len> bytes from SRAM address space into buf[] using an SRAM-based value for <addr>, not an I/O address
 // Note: can't read addresses that correspond to  r28-31 (Y & Z Regs) because Z is used for transfer (not sure why Y is clobbered) 
-void DWreadSramBytes (unsigned int addr, byte *mem, byte len) {
+void DWreadSramBytes (unsigned int addr, byte *mem, unsigned int len) {
+  while (len > 0xFF) { // with a larger MAXBUF, reads are done in chunks of at most 255 bytes
+    DWreadSramBytes(addr, mem, 0xFF);
+    addr += 0xFF;
+    mem += 0xFF;
+    len -= 0xFF;
+  }
   unsigned int len2 = len * 2;
   unsigned int rsp;
   byte rdSram[] = {(byte)(0x66&mon.tmask),                          // Set up for read/write using 
-		   0xD0, mcu.stuckat1byte, 0x1E,                    // Set Start Reg number (r30)
-		   0xD1, mcu.stuckat1byte, 0x20,                    // Set End Reg number (r31) + 1
+		   0xD0, MCUSTUCK, 0x1E,                    // Set Start Reg number (r30)
+		   0xD1, MCUSTUCK, 0x20,                    // Set End Reg number (r31) + 1
 		   0xC2, 0x05,                                      // Set repeating copy to registers via DWDR
 		   0x20,                                            // Go
 		   (byte)(addr & 0xFF), (byte)(addr >> 8),          // r31:r30 (Z) = addr
-		   0xD0, mcu.stuckat1byte, 0x00,                    
-		   0xD1, (byte)((len2 >> 8)+mcu.stuckat1byte), (byte)(len2 & 0xFF),  // Set repeat count = len * 2
+		   0xD0, MCUSTUCK, 0x00,                    
+		   0xD1, (byte)((len2 >> 8)+MCUSTUCK), (byte)(len2 & 0xFF),  // Set repeat count = len * 2
 		   0xC2, 0x00};                                     // Set simulated "ld r?,Z+; out DWDR,r?" instructions
   measureRam();
   
@@ -3974,23 +5830,23 @@ byte DWreadEepromByte (unsigned int addr) {
   unsigned int response;
   byte retval;
   byte setRegs[] = {(byte)(0x66&mon.tmask),                                      // Set up for read/write 
-                    0xD0, mcu.stuckat1byte, 0x1C,                                // Set Start Reg number (r28)
-                    0xD1, mcu.stuckat1byte, 0x20,                                // Set End Reg number (r31) + 1
+                    0xD0, MCUSTUCK, 0x1C,                                // Set Start Reg number (r28)
+                    0xD1, MCUSTUCK, 0x20,                                // Set End Reg number (r31) + 1
                     0xC2, 0x05,                                                  // Set repeating copy to registers via DWDR
                     0x20,                                                        // Go
                     0x01, 0x01, (byte)(addr & 0xFF), (byte)(addr >> 8)};         // Data written into registers r28-r31
-  byte doReadH[] = {0xD2, outHigh(mcu.eearh, 31), outLow(mcu.eearh, 31), 0x23};  // out EEARH,r31  EEARH = ah  EEPROM Address MSB
-  byte doRead[]  = {0xD2, outHigh(mcu.eearl, 30), outLow(mcu.eearl, 30), 0x23,   // out EEARL,r30  EEARL = al  EEPROM Address LSB
-                    0xD2, outHigh(mcu.eecr, 28), outLow(mcu.eecr, 28), 0x23,     // out EECR,r28   EERE = 01 (EEPROM Read Enable)
-                    0xD2, inHigh(mcu.eedr, 29), inLow(mcu.eedr, 29), 0x23,       // in  r29,EEDR   Read data from EEDR
-                    0xD2, outHigh(mcu.dwdr, 29), outLow(mcu.dwdr, 29)};          // out DWDR,r29   Send data back via DWDR reg
+  byte doReadH[] = {0xD2, outHigh(MCUEEARH, 31), outLow(MCUEEARH, 31), 0x23};  // out EEARH,r31  EEARH = ah  EEPROM Address MSB
+  byte doRead[]  = {0xD2, outHigh(MCUEEARL, 30), outLow(MCUEEARL, 30), 0x23,   // out EEARL,r30  EEARL = al  EEPROM Address LSB
+                    0xD2, outHigh(MCUEECR, 28), outLow(MCUEECR, 28), 0x23,     // out EECR,r28   EERE = 01 (EEPROM Read Enable)
+                    0xD2, inHigh(MCUEEDR, 29), inLow(MCUEEDR, 29), 0x23,       // in  r29,EEDR   Read data from EEDR
+                    0xD2, outHigh(MCUDWDR, 29), outLow(MCUDWDR, 29)};          // out DWDR,r29   Send data back via DWDR reg
   measureRam();
   
   DWflushInput();
   dw.sendCmd(setRegs, sizeof(setRegs));
   blockIRQ();
   dw.sendCmd((byte)(0x64&mon.tmask));                                   // Set up for single step using loaded instruction
-  if (mcu.eearh)                                                        // if there is a high byte EEAR reg, set it
+  if (MCUEEARH)                                                        // if there is a high byte EEAR reg, set it
     dw.sendCmd(doReadH, sizeof(doReadH));
   dw.sendCmd(doRead, sizeof(doRead));                                   // set rest of control regs and query
   dw.sendCmd(0x23, true);                                               // Go
@@ -4003,21 +5859,21 @@ byte DWreadEepromByte (unsigned int addr) {
 //   Write one byte to EEPROM
 void DWwriteEepromByte (unsigned int addr, byte val) {
   byte setRegs[] = {(byte)(0x66&mon.tmask),                                       // Set up for read/write 
-                    0xD0, mcu.stuckat1byte, 0x1C,                                 // Set Start Reg number (r30)
-                    0xD1, mcu.stuckat1byte, 0x20,                                 // Set End Reg number (r31) + 1
+                    0xD0, MCUSTUCK, 0x1C,                                 // Set Start Reg number (r30)
+                    0xD1, MCUSTUCK, 0x20,                                 // Set End Reg number (r31) + 1
                     0xC2, 0x05,                                                   // Set repeating copy to registers via DWDR
                     0x20,                                                         // Go
                     0x04, 0x02, (byte)(addr & 0xFF), (byte)(addr >> 8)};          // Data written into registers r28-r31
-  byte doWriteH[] ={0xD2, outHigh(mcu.eearh, 31), outLow(mcu.eearh, 31), 0x23};   // out EEARH,r31  EEARH = ah  EEPROM Address MSB
-  byte doWrite[] = {0xD2, outHigh(mcu.eearl, 30), outLow(mcu.eearl, 30), 0x23,    // out EEARL,r30  EEARL = al  EEPROM Address LSB
-                    0xD2, inHigh(mcu.dwdr, 30), inLow(mcu.dwdr, 30), 0x23,        // in  r30,DWDR   Get data to write via DWDR
+  byte doWriteH[] ={0xD2, outHigh(MCUEEARH, 31), outLow(MCUEEARH, 31), 0x23};   // out EEARH,r31  EEARH = ah  EEPROM Address MSB
+  byte doWrite[] = {0xD2, outHigh(MCUEEARL, 30), outLow(MCUEEARL, 30), 0x23,    // out EEARL,r30  EEARL = al  EEPROM Address LSB
+                    0xD2, inHigh(MCUDWDR, 30), inLow(MCUDWDR, 30), 0x23,        // in  r30,DWDR   Get data to write via DWDR
                     val,                                                          // Data written to EEPROM location
-                    0xD2, outHigh(mcu.eedr, 30), outLow(mcu.eedr, 30), 0x23,      // out EEDR,r30   EEDR = data
-                    0xD2, outHigh(mcu.eecr, 28), outLow(mcu.eecr, 28), 0x23,      // out EECR,r28   EECR = 04 (EEPROM Master Program Enable)
-                    0xD2, outHigh(mcu.eecr, 29), outLow(mcu.eecr, 29), 0x23};     // out EECR,r29   EECR = 02 (EEPROM Program Enable)
+                    0xD2, outHigh(MCUEEDR, 30), outLow(MCUEEDR, 30), 0x23,      // out EEDR,r30   EEDR = data
+                    0xD2, outHigh(MCUEECR, 28), outLow(MCUEECR, 28), 0x23,      // out EECR,r28   EECR = 04 (EEPROM Master Program Enable)
+                    0xD2, outHigh(MCUEECR, 29), outLow(MCUEECR, 29), 0x23};     // out EECR,r29   EECR = 02 (EEPROM Program Enable)
   measureRam();
   dw.sendCmd(setRegs, sizeof(setRegs));
-  if (mcu.eearh)                                                                  // if there is a high byte EEAR reg, set it
+  if (MCUEEARH)                                                                  // if there is a high byte EEAR reg, set it
     dw.sendCmd(doWriteH, sizeof(doWriteH));
   dw.sendCmd(doWrite, sizeof(doWrite));
   _delay_ms(5);                                                                   // allow EEPROM write to complete
@@ -4029,13 +5885,13 @@ void DWreadFlash(unsigned int addr, byte *mem, unsigned int len) {
   unsigned int rsp;
   unsigned int lenx2 = len * 2;
   byte rdFlash[] = {(byte)(0x66&mon.tmask),                             // Set up for read/write
-		    0xD0, mcu.stuckat1byte, 0x1E,                       // Set Start Reg number (r30)
-		    0xD1, mcu.stuckat1byte, 0x20,                       // Set End Reg number (r31) + 1
+		    0xD0, MCUSTUCK, 0x1E,                       // Set Start Reg number (r30)
+		    0xD1, MCUSTUCK, 0x20,                       // Set End Reg number (r31) + 1
 		    0xC2, 0x05,                                         // Set repeating copy to registers via DWDR
 		    0x20,                                               // Go
 		    (byte)(addr & 0xFF), (byte)(addr >> 8),             // r31:r30 (Z) = addr
-		    0xD0, mcu.stuckat1byte, 0x00,                       // Set start = 0
-		    0xD1, (byte)((lenx2 >> 8)+mcu.stuckat1byte),(byte)(lenx2),// Set end = repeat count = sizeof(flashBuf) * 2
+		    0xD0, MCUSTUCK, 0x00,                       // Set start = 0
+		    0xD1, (byte)((lenx2 >> 8)+MCUSTUCK),(byte)(lenx2),// Set end = repeat count = sizeof(flashBuf) * 2
 		    0xC2, 0x02};                                        // Set simulated "lpm r?,Z+; out DWDR,r?" instructions
   measureRam();
   DWflushInput();
@@ -4058,6 +5914,7 @@ void DWeraseFlashPage(unsigned int addr) {
 		    0xD2, 0x95 , 0xE8 }; // execute SPM
   measureRam();
   //DEBPR(F("Erase: "));  DEBLNF(addr,HEX);
+  erasecnt++;
   
   while (timeout < TIMEOUTMAX) {
     DWflushInput();
@@ -4190,7 +6047,7 @@ unsigned int DWgetWPc (boolean corrected) {
   unsigned int pc = getWordResponse(0xF0);
   // DEBPR(F("Get uncorrected WPC=")); DEBLNF(pc,HEX);
   if (corrected) {
-    pc &= ~(mcu.stuckat1byte<<8);
+    pc &= ~(MCUSTUCK<<8);
     pc--;
     // DEBPR(F("Corrected WPC=")); DEBLNF(pc,HEX);
   }
@@ -4208,13 +6065,13 @@ unsigned int DWgetChipId () {
 // set PC Reg (word address) - that is set all the bits (including the ones in the stuckat1byte)
 void DWsetWPc (unsigned int wpcreg) {
   //DEBPR(F("Set WPCReg=")); DEBLNF(wpcreg,HEX);
-  byte cmd[] = {0xD0, (byte)((wpcreg >> 8)+mcu.stuckat1byte), (byte)(wpcreg & 0xFF)};
+  byte cmd[] = {0xD0, (byte)((wpcreg >> 8)+MCUSTUCK), (byte)(wpcreg & 0xFF)};
   dw.sendCmd(cmd, sizeof(cmd));
 }
 
 // set hardware breakpoint at word address
 void DWsetWBp (unsigned int wbp) {
-  byte cmd[] = {0xD1, (byte)((wbp >> 8)+mcu.stuckat1byte), (byte)(wbp & 0xFF)};
+  byte cmd[] = {0xD1, (byte)((wbp >> 8)+MCUSTUCK), (byte)(wbp & 0xFF)};
   dw.sendCmd(cmd, sizeof(cmd));
 }
 
@@ -4339,15 +6196,29 @@ byte ispSend (byte c1, byte c2, byte c3, byte c4, boolean last) {
   return res;
 }
 
+// poll RDY/BSY until the last programming operation has finished,
+// but give up when more than ms milliseconds have elapsed (a poll takes
+// a long time at slow ISP clocks, so the polls are not counted)
+boolean ispWaitReady(byte ms)
+{
+  unsigned long start = millis();
+  
+  while (ispSend(0xF0, 0x00, 0x00, 0x00, true) & 0x01) {
+    if (millis() - start > ms) return false;
+    _delay_us(100);
+  }
+  return true;
+}
+
 
-boolean enterProgramMode (void)
+boolean enterProgramMode (ispspeedtype startspeed)
 {
   byte timeout = 6;
 
   //DEBLN(F("Entering progmode"));
-  ctx.ispspeed = NORMAL_ISP;
+  ctx.ispspeed = startspeed;
   do {
-    if (timeout < 5) ctx.ispspeed = SLOW_ISP;
+    if (timeout < 5 && ctx.ispspeed > SLOW_ISP) ctx.ispspeed = SLOW_ISP;
     if (timeout < 3) ctx.ispspeed = SUPER_SLOW_ISP;
     //DEBLN(F("Do ..."));
     enableSpiPins();
@@ -4364,7 +6235,7 @@ boolean enterProgramMode (void)
     return false;
   } else {
     //DEBLN(F("... successful"));
-    _delay_ms(15);            // wait after enable programming - avrdude does that!
+    ispWaitReady(15);         // wait after enable programming - avrdude waits 15 ms
     return true;
   }
 }
@@ -4396,50 +6267,35 @@ byte ispReadFuse(FuseByte fuse)
   switch (fuse) {
   case LowFuse: return ispSend(0x50, 0x00, 0x00, 0x00, true);
   case HighFuse: return ispSend(0x58, 0x08, 0x00, 0x00, true);
-  case ExtendedFuse: ispSend(0x50, 0x08, 0x00, 0x00, true);
+  case ExtendedFuse: return ispSend(0x50, 0x08, 0x00, 0x00, true);
   }
   return 0;
 }
 
-// program fuse and/or high fuse
+// program one fuse byte (only if its value changes)
 boolean ispProgramFuse(FuseByte fuse, byte fusemsk, byte fuseval)
 {
-  byte lowfuse, highfuse, extfuse;
-  boolean succ = true;
+  byte oldval, newval;
+  static const byte wrcmd[3] PROGMEM = { 0xA0, 0xA8, 0xA4 }; // low, high, extended
 
-  lowfuse = ispSend(0x50, 0x00, 0x00, 0x00, true);
-  highfuse = ispSend(0x58, 0x08, 0x00, 0x00, true);
-  extfuse = ispSend(0x50, 0x08, 0x00, 0x00, true);
-
-  switch (fuse) {
-  case LowFuse: lowfuse = (lowfuse & ~fusemsk) | (fuseval & fusemsk); break;
-  case HighFuse: highfuse = (highfuse & ~fusemsk) | (fuseval & fusemsk); break;
-  case ExtendedFuse: extfuse = (extfuse & ~fusemsk) | (fuseval & fusemsk); break;
-  }
-
-  ispSend(0xAC, 0xA0, 0x00, lowfuse, true);
-  _delay_ms(15);
-  succ &= (ispSend(0x50, 0x00, 0x00, 0x00, true) == lowfuse);
-
-  ispSend(0xAC, 0xA4, 0x00, extfuse, true);
-  _delay_ms(15);
-  succ &= (ispSend(0x50, 0x08, 0x00, 0x00, true) == extfuse);
-
-  ispSend(0xAC, 0xA8, 0x00, highfuse, true);
-  _delay_ms(15);
-  succ &= (ispSend(0x58, 0x08, 0x00, 0x00, true) == highfuse);
-
-  return succ;
+  oldval = ispReadFuse(fuse);
+  newval = (oldval & ~fusemsk) | (fuseval & fusemsk);
+  if (newval == oldval) return true;
+  ispSend(0xAC, pgm_read_byte(&wrcmd[fuse]), 0x00, newval, true);
+  if (!ispWaitReady(15)) return false;
+  return (ispReadFuse(fuse) == newval);
 }
 
 boolean ispEraseFlash(void)
 {
+  boolean ready;
+  
   ispSend(0xAC, 0x80, 0x00, 0x00, true);
-  _delay_ms(20);
+  ready = ispWaitReady(20);
   pinMode(DWLINE, INPUT); // short positive pulse
   _delay_ms(1);
   pinMode(DWLINE, OUTPUT); 
-  return true;
+  return ready;
 }
 
 boolean ispLocked()
@@ -4895,6 +6751,41 @@ int gdbTests(int &num) {
   gdbUpdateBreakpoints(ASSIGN_ALL_BPS);
   failed += testResult(bpcnt == 0 && bpused == 0 && hwbp == 0xFFFF);
 
+  // the HWBP goes to a breakpoint that is alone on its page, although it was
+  // assigned to the most recently inserted one, so that one page write is saved
+  gdbDebugMessagePSTR(PSTR("gdbUpdateBreakpoints (HWBP to lone BP): "), testnum++);
+  unsigned int lone1 = 0xe6 + mcu.targetpgsz/2; // on the page after the test code
+  unsigned int lone2 = lone1 + mcu.targetpgsz/2; // on the page after that
+  long lastsaved = hwbpsaved;
+  gdbInsertBreakpoint(lone1);
+  gdbInsertBreakpoint(0xd5);
+  gdbInsertBreakpoint(0xd6); // same page as 0xd5, gets the HWBP when inserted
+  succ = (hwbp == 0xd6);
+  gdbUpdateBreakpoints(ASSIGN_ALL_BPS);
+  failed += testResult(succ && bpcnt == 3 && hwbp == lone1 && bp[gdbFindBreakpoint(lone1)].hw
+		       && !bp[gdbFindBreakpoint(lone1)].inflash
+		       && bp[gdbFindBreakpoint(0xd5)].inflash && bp[gdbFindBreakpoint(0xd6)].inflash
+		       && hwbpsaved == lastsaved + 1);
+
+  // two breakpoints alone on their pages: the tie goes to the previous owner of the HWBP,
+  // although the other one comes first
+  gdbDebugMessagePSTR(PSTR("gdbUpdateBreakpoints (HWBP tie): "), testnum++);
+  gdbInsertBreakpoint(lone2); // steals the HWBP
+  gdbUpdateBreakpoints(ASSIGN_ALL_BPS);
+  failed += testResult(bpcnt == 4 && hwbp == lone2 && bp[gdbFindBreakpoint(lone2)].hw
+		       && !bp[gdbFindBreakpoint(lone1)].hw && bp[gdbFindBreakpoint(lone1)].inflash
+		       && targetReadFlashWord(lone1*2) == 0x9598 && hwbpsaved == lastsaved + 2);
+
+  // cleanup
+  gdbDebugMessagePSTR(PSTR("Delete BPs & BP update: "), testnum++);
+  gdbRemoveBreakpoint(lone1);
+  gdbRemoveBreakpoint(lone2);
+  gdbRemoveBreakpoint(0xd5);
+  gdbRemoveBreakpoint(0xd6);
+  gdbUpdateBreakpoints(ASSIGN_ALL_BPS);
+  failed += testResult(bpcnt == 0 && bpused == 0 && hwbp == 0xFFFF
+		       && targetReadFlashWord(0xd5*2) == 0 && targetReadFlashWord(0xd6*2) == 0);
+
   // test the illegal opcode detector for single step
   gdbDebugMessagePSTR(PSTR("gdbStep on illegal instruction: "), testnum++);
   ctx.wpc = 0xe6;
@@ -5411,8 +7302,44 @@ int DWtests(int &num)
 #define STK_NOSYNC  0x15    // NAK
 #define CRC_EOP     0x20    // Ok, it is a space...
 
-// Code definitions
-#define EECHUNK   (32)
+#if STK500V2
+// STK500v2 Definitions
+#define MESSAGE_START           0x1B
+#define TOKEN                   0x0E
+
+#define CMD_SIGN_ON             0x01
+#define CMD_SET_PARAMETER       0x02
+#define CMD_GET_PARAMETER       0x03
+#define CMD_OSCCAL              0x05
+#define CMD_LOAD_ADDRESS        0x06
+#define CMD_ENTER_PROGMODE_ISP  0x10
+#define CMD_LEAVE_PROGMODE_ISP  0x11
+#define CMD_CHIP_ERASE_ISP      0x12
+#define CMD_PROGRAM_FLASH_ISP   0x13
+#define CMD_READ_FLASH_ISP      0x14
+#define CMD_PROGRAM_EEPROM_ISP  0x15
+#define CMD_READ_EEPROM_ISP     0x16
+#define CMD_PROGRAM_FUSE_ISP    0x17
+#define CMD_READ_FUSE_ISP       0x18
+#define CMD_PROGRAM_LOCK_ISP    0x19
+#define CMD_READ_LOCK_ISP       0x1A
+#define CMD_READ_SIGNATURE_ISP  0x1B
+#define CMD_READ_OSCCAL_ISP     0x1C
+#define CMD_SPI_MULTI           0x1D
+
+#define PARAM_HW_VER            0x90
+#define PARAM_SW_MAJOR          0x91
+#define PARAM_SW_MINOR          0x92
+#define PARAM_VTARGET           0x94
+
+#define STATUS_CMD_OK           0x00
+#define STATUS_RDY_BSY_TOUT     0x81
+#define STATUS_CMD_FAILED       0xC0
+#define STATUS_CKSUM_ERROR      0xC1
+#define STATUS_CMD_UNKNOWN      0xC9
+
+#define STK2HEAD 10 // message body bytes stored in buf, the rest (page data) goes to newpage
+#endif
 
 // Variables used by In-System Programmer code
 
@@ -5420,6 +7347,7 @@ uint16_t      pagesize;
 uint16_t      eepromsize;
 bool          rst_active_high;
 int           pmode = 0;
+bool          erased;         // chip erase since entering program mode
 unsigned int  here;           // Address for reading and writing, set by 'U' command
 unsigned long  hMask;          // Pagesize mask for 'here" address
 
@@ -5434,7 +7362,11 @@ void ISPprogramming(__attribute__((unused)) boolean fast) {
 
   while (true) {
     if (Serial.available()) {
-      avrisp();
+#if STK500V2
+      if (Serial.peek() == MESSAGE_START) avrisp2();
+      else
+#endif
+	avrisp();
     }
     if (ctx.state != PROG_STATE) {
       if (!fast) {
@@ -5454,12 +7386,191 @@ byte getch (void) {
   return Serial.read();
 }
 
-void fill (int n) {
+void fill (byte *mem, int n) {
   for (int x = 0; x < n; x++) {
-    buf[x] = getch();
+    mem[x] = getch();
   }
 }
 
+// read and discard n bytes of a message that cannot be handled
+void skip (unsigned int n) {
+  while (n--) getch();
+}
+
+// program (length) bytes from newpage starting at word address here,
+// committing each flash page; returns false if a page write timed out
+boolean ispWriteFlash (unsigned int length) {
+  unsigned int ii = 0, seg, pg;
+
+  while (ii < length) {
+    pg = here & hMask;
+    seg = ((unsigned int)(~hMask) + 1 - (here - pg)) * 2; // bytes up to the end of this page
+    if (seg > length - ii) seg = length - ii;
+    if (!ispProgramPage(&newpage[ii], seg, pg)) return false;
+    here += seg/2;
+    ii += seg;
+  }
+  return true;
+}
+
+// load (len) bytes of one page starting at word address here and commit
+// them to the page at word address pg, skipping pages that would not change;
+// returns false if the page write did not finish in time
+boolean ispProgramPage (const byte *data, unsigned int len, unsigned int pg) {
+  unsigned int jj, addr;
+  boolean unchanged;
+
+  unchanged = erased;                         // after a chip erase, blank pages need no write
+  for (jj = 0; jj < len && unchanged; jj++)
+    unchanged = (data[jj] == 0xFF);
+#if ISPCOMPARE
+  if (!unchanged) {                           // page content already there?
+    unchanged = true;
+    for (jj = 0; jj < len && unchanged; jj += 2) {
+      addr = here + jj/2;
+      unchanged = (ispSend(0x20 + LOW * 8, (addr >> 8) & 0xFF, addr & 0xFF, 0, true) == data[jj] &&
+                   ispSend(0x20 + HIGH * 8, (addr >> 8) & 0xFF, addr & 0xFF, 0, true) == data[jj+1]);
+    }
+  }
+#endif
+  if (unchanged) return true;
+  for (jj = 0; jj < len; jj += 2) {
+    addr = here + jj/2;
+    ispSend(0x40 + 8 * LOW, (addr >> 8) & 0xFF, addr & 0xFF, data[jj], true);
+    ispSend(0x40 + 8 * HIGH, (addr >> 8) & 0xFF, addr & 0xFF, data[jj+1], true);
+  }
+  ispSend(0x4C, (pg >> 8) & 0xFF, pg & 0xFF, 0, true); // commit(page);
+  return ispWaitReady(10);
+}
+
+#if ISPLOAD
+// a chip erase clears all of the flash, so an ISP load is only possible if all
+// flash outside of the ranges announced by vFlashErase is blank (e.g., no bootloader);
+// this is checked over debugWIRE, using newpage as the buffer
+boolean ispLoadOnlyBlankOutside(void)
+{
+  unsigned long addr;
+  unsigned int i;
+  byte r;
+
+  if (il.ranges > ISPLOADRANGES) return false;
+  for (addr = 0; addr < mcu.flashsz; addr += mcu.pagesz) {
+    for (r = 0; r < il.ranges; r++) 
+      if (addr >= il.erfirst[r] && addr + mcu.pagesz - 1 <= il.erlast[r]) break;
+    if (r < il.ranges) continue; // page will be erased anyway
+    targetReadFlash(addr, newpage, mcu.pagesz);
+    if (targetOffline()) return false;
+    for (i = 0; i < mcu.pagesz; i++) {
+      if (newpage[i] == 0xFF) continue;
+      for (r = 0; r < il.ranges; r++)
+	if (addr + i >= il.erfirst[r] && addr + i <= il.erlast[r]) break;
+      if (r == il.ranges) return false; // non-blank byte that GDB does not want to erase
+    }
+  }
+  return true;
+}
+
+// leave debugWIRE mode (until the next power-cycle), enter programming mode,
+// and erase the chip, after which the load is programmed page by page
+boolean ispLoadStart(void)
+{
+  gdbUpdateBreakpoints(CLEANUP);
+  gdbDebugMessagePSTR(PSTR(LONGSHORT("Loading by ISP ...", "ISP load")), -1);
+  if (doBreak(true)) 
+    dw.sendCmd(DW_STOP_CMD); // leave debugWIRE mode
+  if (!enterProgramMode() || ispGetChipId() != mcu.sig) {
+    leaveProgramMode();
+    ispLoadReconnect();
+    return false;
+  }
+  if (!ispEraseFlash()) {
+    leaveProgramMode();
+    ispLoadReconnect();
+    return false;
+  }
+  erased = true; // blank pages need not be programmed
+  il.pgvalid = false;
+  validpg = false; // flash cache is outdated
+  return true;
+}
+
+// collect the bytes for one page in newpage and program the page as soon as
+// data for another page arrives
+void ispLoadBytes(unsigned int addr, const byte *mem, unsigned int sz)
+{
+  unsigned int pg;
+
+  while (sz-- && !il.failed) {
+    pg = addr & ~(mcu.pagesz-1);
+    if (!il.pgvalid || pg != il.pgaddr) {
+      ispLoadFlushPage();
+      memset(newpage, 0xFF, mcu.pagesz);
+      il.pgaddr = pg;
+      il.pgvalid = true;
+    }
+    newpage[addr++ - pg] = *mem++;
+  }
+}
+
+// program the page collected in newpage
+void ispLoadFlushPage(void)
+{
+  if (!il.pgvalid) return;
+  here = il.pgaddr/2;
+  il.pgvalid = false;
+  if (!ispProgramPage(newpage, mcu.pagesz, il.pgaddr/2)) {
+    il.failed = true; // reported by the next vFlashWrite or by vFlashDone
+    leaveProgramMode();
+    ispLoadReconnect();
+  }
+}
+
+// program the last page, leave programming mode, and re-enter debugWIRE mode
+boolean ispLoadFinish(void)
+{
+  ispLoadFlushPage();
+  if (il.failed) return false; // already back in debugWIRE mode
+  leaveProgramMode();
+  return ispLoadReconnect();
+}
+
+// DWEN is still programmed, so a power-cycle brings the target back into debugWIRE mode
+boolean ispLoadReconnect(void)
+{
+  setSysState(NOTCONN_STATE);
+  if (powerCycle() && !stuckAtOneOrCap()) {
+    setupDW();
+    return true;
+  }
+  flushInput();
+  targetInitRegisters();
+  return false;
+}
+#endif
+
+// enter programming mode, disabling debugWIRE if necessary
+boolean ispStartProgramming (void) {
+  wdt_reset();
+  if (!pmode) {
+    DEBLN(F("enter PM"));
+    erased = false;
+    if (enterProgramMode()) {
+      DEBLN(F("SUCCESS!"));
+      pmode = 1;
+    } else {
+      DEBLN(F("No prog state"));
+      if (targetSetFuses(DWEN) == 1) {
+	DEBLN(F("DW off"));
+	pmode = 1;
+      } else {
+	DEBLN(F("DW still on"));
+	leaveProgramMode();
+      }
+    }
+  }
+  return pmode;
+}
+
 void empty_reply (void) {
   if (CRC_EOP == getch()) {
     Serial.write(STK_INSYNC);
@@ -5487,7 +7598,7 @@ void avrisp (void) {
   byte ch = getch();
   char memtype;
   char result;
-  unsigned int length, start, remaining, page, ii, addr;
+  unsigned int length, start, ii, addr;
   
   switch (ch) {
     case 0x30:                                  // '0' - 0x30 Get Synchronization (Sign On)
@@ -5524,7 +7635,7 @@ void avrisp (void) {
       break;
       
     case 0x42:                                  // 'B' - 0x42 Set Device Programming Parameters
-      fill(20);
+      fill(buf, 20);
       // AVR devices have active low reset, AT89Sx are active high
       rst_active_high = (buf[0] >= 0xE0);
       pagesize   = (buf[12] << 8) + buf[13];
@@ -5545,29 +7656,12 @@ void avrisp (void) {
       break;
       
     case 0x45:                                  // 'E' - 0x45 Set Extended Device Programming Parameters (ignored)
-      fill(5);
+      fill(buf, 5);
       empty_reply();
       break;
       
     case 0x50:                                  // 'P' - 0x50 Enter Program Mode
-      wdt_reset();
-      if (!pmode) {
-	DEBLN(F("enter PM"));
-	if (enterProgramMode()) {
-	  DEBLN(F("SUCCESS!"));
-	  pmode = 1;
-	} else {
-	  DEBLN(F("No prog state"));
-	  if (targetSetFuses(DWEN) == 1) {
-	    DEBLN(F("DW off"));
-	    pmode = 1;
-	  } else {
-	    DEBLN(F("DW still on"));
-	    leaveProgramMode();
-	  }
-	}
-      }
-      if (pmode) {
+      if (ispStartProgramming()) {
 	empty_reply();
       } else {
 	setSysState(ERROR_STATE);
@@ -5593,7 +7687,8 @@ void avrisp (void) {
 
     case 0x56:                                  // 'V' - 0x56 Universal Command
       if (pmode) wdt_reset();            
-      fill(4);
+      fill(buf, 4);
+      if (buf[0] == 0xAC && buf[1] == 0x80) erased = true; // chip erase
       breply(ispSend(buf[0], buf[1], buf[2], buf[3], true));
       break;
 
@@ -5618,23 +7713,16 @@ void avrisp (void) {
       memtype = getch();
       // flash memory @here, (length) bytes
       if (memtype == 'F') {
-        fill(length);
+        if (length > MAXPAGESIZE) {
+          skip(length);                         // would not fit into newpage
+        } else {
+          fill(newpage, length);
+          result = STK_OK;
+        }
         if (CRC_EOP == getch()) {
           Serial.write((char)STK_INSYNC);
-          ii = 0;
-          page = here & hMask;
-          while (ii < length) {
-            if (page != (here & hMask)) {
-              ispSend(0x4C, (page >> 8) & 0xFF, page & 0xFF, 0, true);  // commit(page);
-              page = here & hMask;
-            }
-            ispSend(0x40 + 8 * LOW, here >> 8 & 0xFF, here & 0xFF, buf[ii++], true);
-            ispSend(0x40 + 8 * HIGH, here >> 8 & 0xFF, here & 0xFF, buf[ii++], true);
-            here++;
-          }
-          ispSend(0x4C, (page >> 8) & 0xFF, page & 0xFF, 0, true);      // commit(page);
-          Serial.write((char)STK_OK);
-          break;
+          if (result == STK_OK && !ispWriteFlash(length)) result = STK_FAILED;
+          Serial.write((char)result);
         } else {
           Serial.write((char)STK_NOSYNC);
         }
@@ -5642,31 +7730,19 @@ void avrisp (void) {
       } else if (memtype == 'E') {
         // here is a word address, get the byte address
         start = here * 2;
-        remaining = length;
-        if (length > eepromsize) {
+        if (length > eepromsize || length > MAXPAGESIZE) {
+          skip(length);
           result = STK_FAILED;
         } else {
-          while (remaining > EECHUNK) {
-            // write (length) bytes, (start) is a byte address
-            // this writes byte-by-byte, page writing may be faster (4 bytes at a time)
-            fill(length);
-            for (ii = 0; ii < EECHUNK; ii++) {
-              addr = start + ii;
-              ispSend(0xC0, (addr >> 8) & 0xFF, addr & 0xFF, buf[ii], true);
-              _delay_ms(45);
-            }
-            start += EECHUNK;
-            remaining -= EECHUNK;
-          }
           // write (length) bytes, (start) is a byte address
           // this writes byte-by-byte, page writing may be faster (4 bytes at a time)
-          fill(length);
-          for (ii = 0; ii < remaining; ii++) {
+          fill(newpage, length);
+          result = STK_OK;
+          for (ii = 0; ii < length && result == STK_OK; ii++) {
             addr = start + ii;
-            ispSend(0xC0, (addr >> 8) & 0xFF, addr & 0xFF, buf[ii], true);
-            _delay_ms(45);
+            ispSend(0xC0, (addr >> 8) & 0xFF, addr & 0xFF, newpage[ii], true);
+            if (!ispWaitReady(10)) result = STK_FAILED;
           }
-          result = STK_OK;
         }
         if (CRC_EOP == getch()) {
           Serial.write((char)STK_INSYNC);
@@ -5735,3 +7811,188 @@ void avrisp (void) {
       }
   }
 }
+
+#if STK500V2
+////////////////////////////////////
+//      STK500v2 (AVR068)
+////////////////////////////////////
+
+byte stk2seq, stk2sum;
+
+// access byte ii of the message body
+byte stk2Body (unsigned int ii) {
+  return (ii < STK2HEAD ? buf[ii] : newpage[ii-STK2HEAD]);
+}
+
+void stk2Send (byte b) {
+  stk2sum ^= b;
+  Serial.write(b);
+}
+
+// send the message header for an answer with a body of (size) bytes
+void stk2Start (unsigned int size, byte cmd) {
+  stk2sum = 0;
+  stk2Send(MESSAGE_START);
+  stk2Send(stk2seq);
+  stk2Send(size >> 8);
+  stk2Send(size & 0xFF);
+  stk2Send(TOKEN);
+  stk2Send(cmd);
+}
+
+void stk2Reply (byte cmd, byte status) {
+  stk2Start(2, cmd);
+  stk2Send(status);
+  Serial.write(stk2sum);
+}
+
+// answer with one result byte, surrounded by status bytes
+void stk2ByteReply (byte cmd, byte b) {
+  stk2Start(4, cmd);
+  stk2Send(STATUS_CMD_OK);
+  stk2Send(b);
+  stk2Send(STATUS_CMD_OK);
+  Serial.write(stk2sum);
+}
+
+// read one message: body bytes go to buf/newpage, answers are streamed
+// so that page-sized blocks need no extra buffer
+void avrisp2 (void) {
+  unsigned int size, ii, num;
+  byte cmd, ch, res = 0, status = STATUS_CMD_OK;
+
+  stk2sum = getch();                            // MESSAGE_START
+  stk2sum ^= (stk2seq = getch());
+  stk2sum ^= (ch = getch());
+  size = ch << 8;
+  stk2sum ^= (ch = getch());
+  size |= ch;
+  stk2sum ^= getch();                           // TOKEN
+  for (ii = 0; ii < size; ii++) {
+    ch = getch();
+    stk2sum ^= ch;
+    if (ii < STK2HEAD) buf[ii] = ch;
+    else if (ii - STK2HEAD < MAXPAGESIZE) newpage[ii-STK2HEAD] = ch;
+  }
+  cmd = buf[0];
+  if (getch() != stk2sum) {
+    stk2Reply(cmd, STATUS_CKSUM_ERROR);
+    return;
+  }
+  if (pmode) wdt_reset();
+  num = (buf[1] << 8) | buf[2];                 // NumBytes for memory commands
+  switch (cmd) {
+  case CMD_SIGN_ON:
+    stk2Start(11, cmd);
+    stk2Send(STATUS_CMD_OK);
+    stk2Send(8);
+    for (const char *p = "AVRISP_2"; *p; p++) stk2Send(*p);
+    Serial.write(stk2sum);
+    return;
+  case CMD_GET_PARAMETER:
+    switch (buf[1]) {
+    case PARAM_HW_VER: res = 0x0F; break;
+    case PARAM_SW_MAJOR: res = 0x02; break;
+    case PARAM_SW_MINOR: res = 0x0A; break;
+    case PARAM_VTARGET: res = 50; break;
+    }
+    stk2Start(3, cmd);
+    stk2Send(STATUS_CMD_OK);
+    stk2Send(res);
+    Serial.write(stk2sum);
+    return;
+  case CMD_SET_PARAMETER:
+  case CMD_OSCCAL:
+    break;
+  case CMD_LOAD_ADDRESS:                        // word address for flash, byte address for EEPROM
+    here = (buf[3] << 8) | buf[4];
+    break;
+  case CMD_ENTER_PROGMODE_ISP:
+    if (!ispStartProgramming()) status = STATUS_CMD_FAILED;
+    break;
+  case CMD_LEAVE_PROGMODE_ISP:
+    leaveProgramMode();
+    pmode = 0;
+    setSysState(NOTCONN_STATE);
+    break;
+  case CMD_CHIP_ERASE_ISP:
+    ispSend(buf[3], buf[4], buf[5], buf[6], true);
+    if (!ispWaitReady(buf[1])) status = STATUS_RDY_BSY_TOUT;
+    else erased = true;
+    break;
+  case CMD_PROGRAM_FLASH_ISP:                   // one page per message (page mode)
+    if (num > MAXPAGESIZE || !(buf[3] & 0x01)) { // too large or word mode, which paged MCUs do not use
+      status = STATUS_CMD_FAILED;
+      break;
+    }
+    if (buf[3] & 0x80) {
+      if (!ispProgramPage(newpage, num, here)) status = STATUS_RDY_BSY_TOUT;
+    } else                                        // only load, commit comes with a later message
+      for (ii = 0; ii < num; ii++) 
+	ispSend(0x40 + (ii & 1) * 8, ((here + ii/2) >> 8) & 0xFF, (here + ii/2) & 0xFF, newpage[ii], true);
+    here += num/2;
+    break;
+  case CMD_PROGRAM_EEPROM_ISP:
+    if (num > MAXPAGESIZE) {                    // the rest of the data has been dropped
+      status = STATUS_CMD_FAILED;
+      break;
+    }
+    for (ii = 0; ii < num; ii++, here++) {
+      ispSend(0xC0, (here >> 8) & 0xFF, here & 0xFF, newpage[ii], true);
+      if (!ispWaitReady(10)) {
+	status = STATUS_RDY_BSY_TOUT;
+	break;
+      }
+    }
+    break;
+  case CMD_READ_FLASH_ISP:
+  case CMD_READ_EEPROM_ISP:
+    stk2Start(num+3, cmd);
+    stk2Send(STATUS_CMD_OK);
+    for (ii = 0; ii < num; ii++) {
+      if (cmd == CMD_READ_FLASH_ISP) {
+	stk2Send(ispSend(0x20 + (ii & 1) * 8, (here >> 8) & 0xFF, here & 0xFF, 0, true));
+	if (ii & 1) here++;
+      } else {
+	stk2Send(ispSend(0xA0, (here >> 8) & 0xFF, here & 0xFF, 0, true));
+	here++;
+      }
+    }
+    stk2Send(STATUS_CMD_OK);
+    Serial.write(stk2sum);
+    return;
+  case CMD_PROGRAM_FUSE_ISP:
+  case CMD_PROGRAM_LOCK_ISP:
+    ispSend(buf[1], buf[2], buf[3], buf[4], true);
+    if (!ispWaitReady(15)) status = STATUS_RDY_BSY_TOUT;
+    stk2Start(3, cmd);
+    stk2Send(status);
+    stk2Send(status);
+    Serial.write(stk2sum);
+    return;
+  case CMD_READ_FUSE_ISP:
+  case CMD_READ_LOCK_ISP:
+  case CMD_READ_SIGNATURE_ISP:
+  case CMD_READ_OSCCAL_ISP:
+    for (ii = 0; ii < 4; ii++) {                // buf[1] is the index (1..4) of the answer byte
+      ch = ispTransfer(buf[2+ii], true);
+      if (ii + 1 == buf[1]) res = ch;
+    }
+    stk2ByteReply(cmd, res);
+    return;
+  case CMD_SPI_MULTI:                           // NumTx, NumRx, RxStartAddr, TxData
+    stk2Start(buf[2]+3, cmd);
+    stk2Send(STATUS_CMD_OK);
+    for (ii = 0; ii < buf[1] || ii < buf[3] + buf[2]; ii++) {
+      ch = ispTransfer(ii < buf[1] ? stk2Body(4+ii) : 0, true);
+      if (ii >= buf[3] && ii < buf[3] + buf[2]) stk2Send(ch);
+    }
+    stk2Send(STATUS_CMD_OK);
+    Serial.write(stk2sum);
+    return;
+  default:
+    status = STATUS_CMD_UNKNOWN;
+  }
+  stk2Reply(cmd, status);
+}
+#endif
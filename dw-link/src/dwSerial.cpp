@@ -15,6 +15,7 @@
 //
 dwSerial::dwSerial(void)  
 {
+  sent = 0;
 }
 
 //
@@ -29,6 +30,18 @@ void dwSerial::sendBreak(void)
   ICDDR &= ~_BV(ICBIT); // and switch it back to being an input
 }
 
+// short break of 20 bit times when the speed of the target is known,
+// i.e., twice the length of a character frame
+void dwSerial::sendBreak(unsigned long bps)
+{
+  unsigned long cnt = 2000000UL/bps + 1; // in units of 10 us
+
+  enable(false);
+  ICDDR |= _BV(ICBIT);
+  while (cnt--) _delay_us(10);
+  ICDDR &= ~_BV(ICBIT);
+}
+
 
 
 size_t dwSerial::sendCmd(const uint8_t *loc, uint8_t len, bool fastReturn)
@@ -39,6 +52,7 @@ size_t dwSerial::sendCmd(const uint8_t *loc, uint8_t len, bool fastReturn)
     SingleWireSerial::write(loc[i]);
   }
   SingleWireSerial::_finishSendingEarly = false;
+  sent += len;
   return len;
 }
 
@@ -48,6 +62,7 @@ size_t dwSerial::sendCmd(uint8_t cmd, bool fastReturn)
   SingleWireSerial::_finishSendingEarly = fastReturn;
   SingleWireSerial::write(cmd);
   SingleWireSerial::_finishSendingEarly = false;
+  sent++;
   return 1;
 }
 
@@ -60,9 +75,10 @@ void dwSerial::enable(bool active)
 }
 
 
-unsigned long dwSerial::calibrate()
+// maxwait is the time to wait for the first falling edge in us (roughly)
+unsigned long dwSerial::calibrate(unsigned long maxwait)
 {
-  unsigned long timeout = 900000UL; // means roughly 800 ms
+  unsigned long timeout = maxwait + maxwait/8; // 900000 means roughly 800 ms
   unsigned long bps, eightbits = 0;
   byte edges;
   byte saveSREG;
@@ -26,11 +26,14 @@ class dwSerial : public SingleWireSerial
  public:
   // public methods
   dwSerial(void);
-  unsigned long calibrate(void);
+  unsigned long calibrate(unsigned long maxwait = 800000UL);
   void sendBreak();
+  void sendBreak(unsigned long bps);
   size_t sendCmd(const uint8_t  *buf, uint8_t len, bool fastReturn = false);
   size_t sendCmd(uint8_t cmd, bool fastReturn = false);
   void enable(bool);
+
+  unsigned long sent; // number of bytes sent with sendCmd
 };
 
 
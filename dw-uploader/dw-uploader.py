@@ -3,7 +3,7 @@
 Uploader for dw-link firmware
 Based on STK500v1 implementation by Mathieu Virbel <mat@meltingrocks.com>
 """
-VERSION="1.0.0"
+VERSION="1.1.0"
 
 import os
 import sys
@@ -11,8 +11,9 @@ import serial
 import serial.tools.list_ports
 import struct
 import progressbar
+from concurrent.futures import ThreadPoolExecutor
 from intelhex import IntelHex
-from time import sleep
+from time import sleep, time
 
 STK_LOAD_ADDRESS = 0x55
 STK_PROG_PAGE = 0x64
@@ -41,6 +42,9 @@ MEM_PARTS_328P = {
 
 DEBUG = "DEBUG" in os.environ
 
+# USB vendor IDs of the boards dw-link runs on: Arduino, Arduino.org, WCH (CH340), FTDI
+PROBE_VIDS = [ 0x2341, 0x2A03, 0x1A86, 0x0403 ]
+
 if DEBUG:
     def debug_print(x, *largs):
         print(x.format(*largs))
@@ -98,7 +102,7 @@ class Uploader(object):
             self.con.close()
             self.con = None
 
-    def upload(self, fname):
+    def upload(self, fname, delta=False):
         self.try_connect()
 
         self.ih.loadhex(fname)
@@ -109,63 +113,52 @@ class Uploader(object):
 
         buf = self.ih.tobinarray()
         prog_size = len(buf)
+        assert(mem["pagesize"] * mem["pagecount"] == mem["size"])
+        pages = list(range(0, prog_size, mem["pagesize"]))
+
+        # with the same firmware version on the probe, only differing pages are programmed
+        if delta:
+            bar = self.progress('Compare: ', prog_size)
+            differing = []
+            for addr in pages:
+                bar.update(addr)
+                self.load_addr(addr)
+                expected = bytes(buf[addr:addr + mem["pagesize"]])
+                if self.read_page(memtype, mem["pagesize"])[:len(expected)] != expected:
+                    differing += [ addr ]
+            bar.update(prog_size)
+            print("")
+            pages = differing
+            print("{:d} page(s) differ".format(len(pages)))
 
         # flash the device
-        assert(mem["pagesize"] * mem["pagecount"] == mem["size"])
-        progress = 0
-        bar = progressbar.ProgressBar(
-            widgets=[
-                'Upload: ',
-                progressbar.Bar(),
-                ' ',
-                progressbar.Counter(format='%(value)02d/%(max_value)d'),
-                ' ',
-                progressbar.FileTransferSpeed(),
-                ' ',
-                progressbar.ETA()
-            ], max_value=prog_size
-        )
-        for addr in range(0, prog_size + mem["pagesize"], mem["pagesize"]):
-            if addr > prog_size:
-                sleep(0.1)
-                bar.update(prog_size)
-                break
-            bar.update(addr)
-            page = buf[addr:addr + mem["pagesize"]]
-            self.load_addr(addr)
-            self.prog_page(memtype, page)
-        print("")
-        # verify the device
-        assert(mem["pagesize"] * mem["pagecount"] == mem["size"])
-        progress = 0
-        bar = progressbar.ProgressBar(
-            widgets=[
-                'Verify: ',
-                progressbar.Bar(),
-                ' ',
-                progressbar.Counter(format='%(value)02d/%(max_value)d'),
-                ' ',
-                progressbar.FileTransferSpeed(),
-                ' ',
-                progressbar.ETA()
-            ], max_value=prog_size
-        )
-        for addr in range(0, prog_size + mem["pagesize"], mem["pagesize"]):
-            if addr > prog_size:
-                sleep(0.1)
-                bar.update(prog_size)
-                break
-            bar.update(addr)
-            self.load_addr(addr)
-            expected = bytes(buf[addr:addr + mem["pagesize"]])
-            page = self.read_page(memtype, mem["pagesize"])[:len(expected)]
-            if page != expected:
-                print("\nVerification error in page with base address 0x%X" % addr)
-                diffix = self.finddiff(page, expected)
-                print("Address of first diff: 0x{:04X}".format(diffix+addr))
-                print("Expected: 0x{:02X}".format(expected[diffix]))
-                print("Read:     0x{:02X}".format(page[diffix]))
-                break
+        if pages:
+            bar = self.progress('Upload: ', prog_size)
+            for addr in pages:
+                bar.update(addr)
+                self.load_addr(addr)
+                self.prog_page(memtype, buf[addr:addr + mem["pagesize"]])
+            sleep(0.1)
+            bar.update(prog_size)
+            print("")
+
+        # verify the programmed pages
+        if pages:
+            bar = self.progress('Verify: ', prog_size)
+            for addr in pages:
+                bar.update(addr)
+                self.load_addr(addr)
+                expected = bytes(buf[addr:addr + mem["pagesize"]])
+                page = self.read_page(memtype, mem["pagesize"])[:len(expected)]
+                if page != expected:
+                    print("\nVerification error in page with base address 0x%X" % addr)
+                    diffix = self.finddiff(page, expected)
+                    print("Address of first diff: 0x{:04X}".format(diffix+addr))
+                    print("Expected: 0x{:02X}".format(expected[diffix]))
+                    print("Read:     0x{:02X}".format(page[diffix]))
+                    break
+            sleep(0.1)
+            bar.update(prog_size)
         self.leave_progmode()
         print("\nAll done!")
         sleep(0.1)
@@ -177,6 +170,19 @@ class Uploader(object):
         else:
             print("dw-link did not respond to initial communication attempt")
 
+    def progress(self, title, size):
+        return progressbar.ProgressBar(
+            widgets=[
+                title,
+                progressbar.Bar(),
+                ' ',
+                progressbar.Counter(format='%(value)02d/%(max_value)d'),
+                ' ',
+                progressbar.FileTransferSpeed(),
+                ' ',
+                progressbar.ETA()
+            ], max_value=size
+        )
 
     def finddiff(self, observed, expected):
         for i in range(min(len(observed), len(expected))):
@@ -335,37 +341,74 @@ class Uploader(object):
             sleep(0.01)
 
 
+def probe(device, timeout=2.5):
+    """
+    Return the firmware version if there is a dw-link probe at device, otherwise None.
+    Opening the port resets the board, so we send ENQs until the sketch has started.
+    """
+    try:
+        with serial.Serial(device, baudrate=115200, timeout=0.1, write_timeout=0.1) as con:
+            deadline = time() + timeout
+            while time() < deadline:
+                con.reset_input_buffer()
+                con.write(b'\x05') # ENQ
+                resp = con.read(16)
+                if resp.startswith(b"dw-link"):
+                    return resp[7:].decode(errors="ignore").strip()
+    except Exception as e:
+        debug_print("[STK500] Probing {} failed: {}", device, e)
+    return None
+
 def discover():
     ports = []
+    candidates = []
     for s in serial.tools.list_ports.comports(True):
         if s.device.startswith('/dev/tty.') or s.device in ["/dev/cu.Bluetooth-Incoming-Port",
                                                                 "/dev/cu.debug-console"]:
             continue
         ports += [ s.device ]
-    debug_print("[STK500] Discovered ports: %s" % ports)
+        if s.vid in PROBE_VIDS:
+            candidates += [ s.device ]
+    debug_print("[STK500] Discovered ports: {}", ports)
     if ports == []:
         print("No ports discovered")
-        return None
-    if len(ports) == 1:
+        return None, None
+    # probe all candidate ports at the same time; probing resets the board
+    # and sends an ENQ, so other USB devices are left alone
+    versions = dict.fromkeys(ports)
+    if candidates:
+        with ThreadPoolExecutor(max_workers=len(candidates)) as pool:
+            versions.update(zip(candidates, pool.map(probe, candidates)))
+    debug_print("[STK500] Probed versions: {}", versions)
+    probes = [ p for p in ports if versions[p] is not None ]
+    if len(probes) == 1:
+        print("Will use %s for upload (dw-link %s)" % (probes[0], versions[probes[0]]))
+        return probes[0], versions[probes[0]]
+    if probes:
+        ports = probes
+    elif len(ports) == 1:
         print("Will use %s for upload" % ports[0])
-        return ports[0]
+        return ports[0], None
     print("Choose from the following ports:")
     for p in enumerate(ports):
-        print("{:d}: {}".format(p[0], p[1]))
+        if versions[p[1]] is None:
+            print("{:d}: {}".format(p[0], p[1]))
+        else:
+            print("{:d}: {} (dw-link {})".format(p[0], p[1], versions[p[1]]))
     try:
         c = int(input("Choice [0-{}]: ".format(len(ports)-1)))
     except:
         c = -1
     if c < 0 or c >= len(ports):
         print("Impossible choice")
-        return None
-    return ports[c]
+        return None, None
+    return ports[c], versions[ports[c]]
 
-def upload(device, fname):
+def upload(device, fname, delta=False):
     if device is None:
         return 0
     try:
-        Uploader(device).upload(fname)
+        Uploader(device).upload(fname, delta)
     except KeyboardInterrupt:
         print("\nGoodbye")
         sys.exit(0)
@@ -382,7 +425,10 @@ if __name__ == "__main__":
             DWVERSION = f.readline().strip()
     print("dw-link ({}) firmware uploader v{:s}".format(DWVERSION, VERSION))
     if os.path.exists(os.path.abspath(os.path.join(os.path.dirname(__file__), "dw-link.hex"))):
-        upload(discover(), os.path.abspath(os.path.join(os.path.dirname(__file__), "dw-link.hex")))
+        device, version = discover()
+        # same version already there: program only the pages that differ
+        delta = version is not None and version == DWVERSION.lstrip("v")
+        upload(device, os.path.abspath(os.path.join(os.path.dirname(__file__), "dw-link.hex")), delta)
     else:
         print("There is no file 'dw-link.hex' to upload")
         sys.exit(1)
\ No newline at end of file